@@ -0,0 +1,307 @@
+// Drives `cache` over `mock_db` from several threads and prints a JSON
+// report: throughput, per operation latency percentiles, hit ratio and
+// how many calls reached the upstream.
+#include "cache.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "mock_db.h"
+
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+struct bench_opts {
+    int threads = 4;
+    int keys = 10000;
+    long ops = 200000; // per thread
+    double zipf = 0.99; // 0 means uniform
+    int read_pct = 90;
+    int write_pct = 8;
+    int delete_pct = 2;
+    int value_min = 16;
+    int value_max = 128;
+    uint64_t ttl = 12;
+    bool write_back = false;
+    bool prefill = true;
+    int near_slots = 0;
+    wal_config wal;
+};
+
+const char *usage =
+    R"(usage: cache_bench [options]
+    --threads <n>        worker threads (default 4)
+    --keys <n>           key space size (default 10000)
+    --ops <n>            operations per thread (default 200000)
+    --zipf <theta>       key skew, 0 for uniform (default 0.99)
+    --mix <r>/<w>/<d>    read/write/delete percentages (default 90/8/2)
+    --value-size <a>-<b> value size range in bytes (default 16-128)
+    --ttl <seconds>      cache ttl (default 12)
+    --write-back         use write-back mode
+    --no-prefill         start with an empty upstream
+    --near-cache <slots> per thread near cache size (default off)
+    --wal <path>         durable mock_db, logs to <path> (truncated first)
+    --wal-interval <us>  group commit wait before each log write (default 0)
+    )";
+
+// counts what the cache asks of its upstream
+struct counting_db : public i_db {
+    explicit counting_db(i_db *inner) : m_inner(inner) {}
+
+    bool begin_transaction() override {
+        return m_inner->begin_transaction();
+    }
+    bool commit_transaction() override {
+        return m_inner->commit_transaction();
+    }
+    bool abort_transaction() override {
+        return m_inner->abort_transaction();
+    }
+    std::string get(const std::string &key) override {
+        gets.fetch_add(1, std::memory_order_relaxed);
+        return m_inner->get(key);
+    }
+    std::string set(const std::string &key, const std::string &data) override {
+        sets.fetch_add(1, std::memory_order_relaxed);
+        return m_inner->set(key, data);
+    }
+    std::string remove(const std::string &key) override {
+        removes.fetch_add(1, std::memory_order_relaxed);
+        return m_inner->remove(key);
+    }
+
+    std::atomic<uint64_t> gets = 0;
+    std::atomic<uint64_t> sets = 0;
+    std::atomic<uint64_t> removes = 0;
+
+  private:
+    i_db *m_inner;
+};
+
+// Zipfian ranks in [0, n), the generator from Gray et al.
+// "Quickly Generating Billion-Record Synthetic Databases" as used by YCSB
+struct zipf_gen {
+    zipf_gen(uint64_t n, double theta) : m_n(n), m_theta(theta) {
+        if (theta <= 0) {
+            return;
+        }
+        for (uint64_t i = 1; i <= n; ++i) {
+            m_zetan += 1.0 / std::pow(double(i), theta);
+        }
+        const double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        m_alpha = 1.0 / (1.0 - theta);
+        m_eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) /
+                (1.0 - zeta2 / m_zetan);
+    }
+
+    template <typename Rng> uint64_t operator()(Rng &rng) {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        if (m_theta <= 0) {
+            return uint64_t(u * m_n) % m_n;
+        }
+        double uz = u * m_zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, m_theta)) {
+            return 1;
+        }
+        return uint64_t(m_n * std::pow(m_eta * u - m_eta + 1.0, m_alpha)) %
+               m_n;
+    }
+
+  private:
+    uint64_t m_n;
+    double m_theta;
+    double m_zetan = 0;
+    double m_alpha = 0;
+    double m_eta = 0;
+};
+
+static std::string key_of(uint64_t rank) {
+    // spread hot ranks over the hash space
+    return "key:" + std::to_string(rank * 0x9E3779B97F4A7C15ull >> 20);
+}
+
+static bool parse_args(int argc, char *argv[], bench_opts &opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const bool has_val = i + 1 < argc;
+        if (arg == "--write-back") {
+            opts.write_back = true;
+        } else if (arg == "--no-prefill") {
+            opts.prefill = false;
+        } else if (arg == "--threads" && has_val) {
+            opts.threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--keys" && has_val) {
+            opts.keys = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--ops" && has_val) {
+            opts.ops = std::atol(argv[++i]);
+        } else if (arg == "--zipf" && has_val) {
+            opts.zipf = std::atof(argv[++i]);
+        } else if (arg == "--near-cache" && has_val) {
+            opts.near_slots = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--wal" && has_val) {
+            opts.wal.path = argv[++i];
+        } else if (arg == "--wal-interval" && has_val) {
+            opts.wal.flush_interval =
+                std::chrono::microseconds(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--ttl" && has_val) {
+            opts.ttl = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--mix" && has_val) {
+            char sep;
+            std::istringstream in(argv[++i]);
+            in >> opts.read_pct >> sep >> opts.write_pct >> sep >>
+                opts.delete_pct;
+            if (!in ||
+                opts.read_pct + opts.write_pct + opts.delete_pct != 100) {
+                return false;
+            }
+        } else if (arg == "--value-size" && has_val) {
+            char sep;
+            std::istringstream in(argv[++i]);
+            in >> opts.value_min >> sep >> opts.value_max;
+            if (!in || opts.value_min < 1 || opts.value_max < opts.value_min) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    bench_opts opts;
+    if (!parse_args(argc, argv, opts)) {
+        std::cerr << usage;
+        return -1;
+    }
+
+    std::unique_ptr<mock_db> db_ptr;
+    if (opts.wal.path.empty()) {
+        db_ptr = std::make_unique<mock_db>();
+    } else {
+        // every run starts from the same empty log
+        std::remove(opts.wal.path.c_str());
+        db_ptr = std::make_unique<mock_db>(opts.wal);
+    }
+    mock_db &db = *db_ptr;
+    if (!db.ok()) {
+        std::cerr << "can't open write-ahead log " << opts.wal.path << "\n";
+        return -1;
+    }
+    if (opts.prefill) {
+        // one transaction, so a durable upstream logs it as one frame
+        db.begin_transaction();
+        for (int k = 0; k < opts.keys; ++k) {
+            db.set(key_of(k), std::string(opts.value_min, 'p'));
+        }
+        db.commit_transaction();
+    }
+    counting_db upstream(&db);
+    cache_config cfg;
+    if (opts.write_back) {
+        cfg.policy = write_policy::back;
+    }
+    cfg.near_slots = opts.near_slots;
+    auto ch = std::make_unique<cache>(&upstream, opts.ttl, cfg);
+
+    zipf_gen zipf(opts.keys, opts.zipf);
+    latency_histogram get_h, set_h, del_h;
+    std::atomic<uint64_t> get_misses = 0;
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < opts.threads; ++t) {
+        workers.emplace_back([&, t] {
+            // thread private copies, merged once at the end
+            auto local = std::make_unique<latency_histogram[]>(3);
+            zipf_gen keys = zipf;
+            std::mt19937_64 rng(t + 1);
+            std::uniform_int_distribution<int> op_dist(0, 99);
+            std::uniform_int_distribution<int> size_dist(opts.value_min,
+                                                         opts.value_max);
+            const std::string payload(opts.value_max, 'v');
+            uint64_t misses = 0;
+
+            for (long i = 0; i < opts.ops; ++i) {
+                const std::string key = key_of(keys(rng));
+                const int op = op_dist(rng);
+                auto op_start = std::chrono::steady_clock::now();
+                int kind;
+                if (op < opts.read_pct) {
+                    kind = 0;
+                    misses += ch->get(key) == "";
+                } else if (op < opts.read_pct + opts.write_pct) {
+                    kind = 1;
+                    ch->set(key, payload.substr(0, size_dist(rng)));
+                } else {
+                    kind = 2;
+                    ch->remove(key);
+                }
+                auto op_end = std::chrono::steady_clock::now();
+                local[kind].record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        op_end - op_start)
+                        .count());
+            }
+            get_h.merge(local[0]);
+            set_h.merge(local[1]);
+            del_h.merge(local[2]);
+            get_misses += misses;
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    // write-back keeps writes pending, count them as part of the run
+    ch->flush();
+    auto flushed = std::chrono::steady_clock::now();
+    const std::string cache_stats = ch->stats_json();
+    ch.reset();
+
+    const double secs = std::chrono::duration<double>(end - start).count();
+    const uint64_t total = uint64_t(opts.ops) * opts.threads;
+    const uint64_t reads = get_h.count();
+    // every read that isn't answered by the cache goes upstream
+    const double hit_ratio =
+        reads == 0 ? 0.0
+                   : 1.0 - std::min<double>(upstream.gets, reads) / reads;
+
+    std::ostringstream os;
+    os << "{\n"
+       << "  \"config\": {\"threads\": " << opts.threads
+       << ", \"keys\": " << opts.keys << ", \"ops_per_thread\": " << opts.ops
+       << ", \"zipf\": " << opts.zipf << ", \"mix\": \"" << opts.read_pct
+       << "/" << opts.write_pct << "/" << opts.delete_pct
+       << "\", \"value_size\": \"" << opts.value_min << "-" << opts.value_max
+       << "\", \"ttl\": " << opts.ttl << ", \"write_policy\": \""
+       << (opts.write_back ? "back" : "through")
+       << "\", \"near_slots\": " << opts.near_slots << ", \"wal\": "
+       << (opts.wal.path.empty() ? "false" : "true") << "},\n"
+       << "  \"seconds\": " << secs << ",\n"
+       << "  \"ops_per_sec\": " << uint64_t(total / secs) << ",\n"
+       << "  \"final_flush_ms\": "
+       << std::chrono::duration<double, std::milli>(flushed - end).count()
+       << ",\n"
+       << "  \"hit_ratio\": " << hit_ratio << ",\n"
+       << "  \"get_misses\": " << get_misses << ",\n"
+       << "  \"upstream\": {\"get\": " << upstream.gets
+       << ", \"set\": " << upstream.sets << ", \"remove\": " << upstream.removes
+       << "},\n"
+       << "  \"latency\": {\n    \"get\": ";
+    histogram_json(os, get_h);
+    os << ",\n    \"set\": ";
+    histogram_json(os, set_h);
+    os << ",\n    \"remove\": ";
+    histogram_json(os, del_h);
+    os << "\n  },\n"
+       << "  \"cache_stats\": " << cache_stats << ",\n"
+       << "  \"upstream_stats\": " << db.stats_json() << "\n}\n";
+    std::cout << os.str();
+    return 0;
+}
@@ -0,0 +1,340 @@
+#pragma once
+#include "flat_map.h"
+
+#include "stdint.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+
+// Lock policies. A cache only ever used by one thread picks
+// null_lock_policy, all locking then compiles to nothing.
+struct shared_lock_policy {
+    using mutex_type = std::shared_mutex;
+    static constexpr bool concurrent = true;
+};
+struct null_lock_policy {
+    struct mutex_type {
+        void lock() {}
+        bool try_lock() { return true; }
+        void unlock() {}
+        void lock_shared() {}
+        bool try_lock_shared() { return true; }
+        void unlock_shared() {}
+    };
+    static constexpr bool concurrent = false;
+};
+
+// Expiry policies, times are unix seconds. With Background a thread drops
+// expired entries every 2 * ttl, otherwise they are only skipped by reads
+// until the owner calls expire() or overwrites them.
+template <bool Background = true> struct ttl_expiry {
+    static constexpr bool expires = true;
+    static constexpr bool background = Background;
+
+    std::chrono::seconds ttl{12};
+
+    static uint64_t now() {
+        return std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now());
+    }
+    uint64_t deadline(uint64_t now) const { return now + ttl.count(); }
+    std::chrono::seconds sweep_interval() const {
+        return std::max(ttl * 2, std::chrono::seconds(1));
+    }
+};
+// entries live until removed, reads don't even look at the clock
+struct no_expiry {
+    static constexpr bool expires = false;
+    static constexpr bool background = false;
+
+    static uint64_t now() { return 0; }
+    uint64_t deadline(uint64_t) const { return UINT64_MAX; }
+};
+
+// Eviction policies, consulted before every insert with the lock held.
+struct no_eviction {
+    template <typename Storage, typename OnDrop>
+    void make_room(Storage &, OnDrop &&) {}
+};
+// Keeps at most `max_entries`. To make room it looks at `samples` entries
+// from a rotating position and drops the one written longest ago, which
+// approximates LRU by write time without a per entry list.
+struct sampled_eviction {
+    explicit sampled_eviction(size_t max_entries = 1 << 16,
+                              size_t samples = 8)
+        : max_entries(max_entries), samples(samples) {}
+
+    size_t max_entries;
+    size_t samples;
+
+    template <typename Storage, typename OnDrop>
+    void make_room(Storage &s, OnDrop &&on_drop) {
+        while (s.size() >= std::max<size_t>(max_entries, 1)) {
+            const typename Storage::entry_type *oldest = nullptr;
+            size_t seen = 0;
+            for (size_t scanned = 0;
+                 seen < samples && scanned < s.capacity(); ++scanned) {
+                m_cursor = (m_cursor + 1) % s.capacity();
+                s.for_each_in(m_cursor, m_cursor + 1, [&](const auto &e) {
+                    if (oldest == nullptr || e.version < oldest->version) {
+                        oldest = &e;
+                    }
+                    ++seen;
+                });
+            }
+            on_drop(*oldest);
+            s.erase_entry(*oldest);
+        }
+    }
+
+  private:
+    size_t m_cursor = 0;
+};
+
+// Storage for typed values, the same shape as flat_map: entries carry
+// their expiry and a write version, for_each_in walks buckets.
+template <typename Key, typename Value> struct hash_storage {
+    struct entry_type {
+        uint64_t expires_at = 0;
+        uint64_t version = 0;
+        Value val{};
+        const Key *key_ptr = nullptr;
+
+        const Key &key() const { return *key_ptr; }
+        const Value &value() const { return val; }
+    };
+
+    size_t size() const { return m_map.size(); }
+    size_t capacity() const { return m_map.bucket_count(); }
+
+    template <typename K> entry_type *find(const K &key) {
+        auto it = m_map.find(key);
+        return it == m_map.end() ? nullptr : &it->second;
+    }
+    template <typename K, typename V>
+    entry_type &assign(const K &key, const V &value, uint64_t expires_at) {
+        auto it = m_map.find(key);
+        if (it == m_map.end()) {
+            it = m_map.try_emplace(Key(key)).first;
+            it->second.key_ptr = &it->first;
+        }
+        it->second.val = value;
+        it->second.expires_at = expires_at;
+        return it->second;
+    }
+    template <typename K> bool erase(const K &key) {
+        auto it = m_map.find(key);
+        if (it == m_map.end()) {
+            return false;
+        }
+        m_map.erase(it);
+        return true;
+    }
+    void erase_entry(const entry_type &e) { m_map.erase(m_map.find(e.key())); }
+
+    template <typename Pred> size_t erase_if(Pred pred) {
+        return std::erase_if(m_map, [&](const auto &kv) {
+            return pred(kv.second);
+        });
+    }
+    template <typename F> void for_each_in(size_t from, size_t to, F f) const {
+        to = std::min(to, m_map.bucket_count());
+        for (size_t b = from; b < to; ++b) {
+            for (auto it = m_map.begin(b); it != m_map.end(b); ++it) {
+                f(it->second);
+            }
+        }
+    }
+    void reserve(size_t n) { m_map.reserve(n); }
+    void clear() { m_map.clear(); }
+
+  private:
+    using hasher = std::conditional_t<std::is_same_v<Key, std::string>,
+                                      string_hash, std::hash<Key>>;
+    std::unordered_map<Key, entry_type, hasher, std::equal_to<>> m_map;
+};
+
+// string to string caches keep using flat_map and its slab arena
+template <typename Key, typename Value> struct cache_storage {
+    using type = hash_storage<Key, Value>;
+};
+template <> struct cache_storage<std::string, std::string> {
+    using type = flat_map;
+};
+
+// Key/value cache whose locking, eviction and expiry are picked at compile
+// time. `cache` builds the i_db layer on top of one instantiation, embedded
+// users pick cheaper ones, e.g. a single threaded cache of POD structs:
+//
+//   basic_cache<uint64_t, point, null_lock_policy, no_eviction, no_expiry>
+//
+// has no mutex, no background thread and copies values as they are.
+//
+// The typed calls below take the lock themselves. Owners layering more on
+// top may use storage() directly while holding mutex(), exclusively for
+// changes, and should store through store_locked() so eviction and
+// versions stay in effect.
+template <typename Key, typename Value,
+          typename LockPolicy = shared_lock_policy,
+          typename EvictionPolicy = no_eviction,
+          typename ExpiryPolicy = ttl_expiry<>>
+struct basic_cache {
+    static_assert(!ExpiryPolicy::background || LockPolicy::concurrent,
+                  "a background sweeper needs a concurrent lock policy");
+
+    using storage_type = typename cache_storage<Key, Value>::type;
+    using entry_type = typename storage_type::entry_type;
+    using mutex_type = typename LockPolicy::mutex_type;
+    // string keys and values are passed as views
+    using key_arg = std::conditional_t<std::is_same_v<Key, std::string>,
+                                       std::string_view, const Key &>;
+    using value_arg = std::conditional_t<std::is_same_v<Value, std::string>,
+                                         std::string_view, const Value &>;
+    // told about every entry the cache drops on its own (expiry, eviction),
+    // called with the lock held
+    using drop_fn = std::function<void(const entry_type &)>;
+
+    explicit basic_cache(ExpiryPolicy expiry = {},
+                         EvictionPolicy eviction = {}, drop_fn on_drop = {})
+        : m_expiry(expiry), m_eviction(eviction),
+          m_on_drop(std::move(on_drop)) {
+        if constexpr (ExpiryPolicy::background) {
+            m_sweeper.start(this);
+        }
+    }
+    ~basic_cache() {
+        if constexpr (ExpiryPolicy::background) {
+            m_sweeper.stop();
+        }
+    }
+    basic_cache(const basic_cache &) = delete;
+    basic_cache &operator=(const basic_cache &) = delete;
+
+    bool get(key_arg key, Value &out) {
+        const uint64_t now = ExpiryPolicy::now();
+        std::shared_lock lock(m_mutex_);
+        const entry_type *e = m_storage.find(key);
+        if (e == nullptr || e->expires_at <= now) {
+            return false;
+        }
+        out = Value(e->value());
+        return true;
+    }
+    std::optional<Value> get(key_arg key) {
+        Value v;
+        if (!get(key, v)) {
+            return std::nullopt;
+        }
+        return v;
+    }
+
+    void set(key_arg key, value_arg value) {
+        const uint64_t deadline = m_expiry.deadline(ExpiryPolicy::now());
+        std::unique_lock lock(m_mutex_);
+        store_locked(key, value, deadline);
+    }
+
+    bool remove(key_arg key) {
+        std::unique_lock lock(m_mutex_);
+        return m_storage.erase(key);
+    }
+
+    // drops expired entries now, returns how many
+    size_t expire() {
+        if constexpr (!ExpiryPolicy::expires) {
+            return 0;
+        } else {
+            const uint64_t now = ExpiryPolicy::now();
+            std::unique_lock lock(m_mutex_);
+            return m_storage.erase_if([&](const entry_type &e) {
+                if (e.expires_at > now) {
+                    return false;
+                }
+                if (m_on_drop) {
+                    m_on_drop(e);
+                }
+                return true;
+            });
+        }
+    }
+
+    size_t size() const {
+        std::shared_lock lock(m_mutex_);
+        return m_storage.size();
+    }
+
+    void clear() {
+        std::unique_lock lock(m_mutex_);
+        m_storage.clear();
+    }
+
+    // building blocks for owners, see above
+    mutex_type &mutex() const { return m_mutex_; }
+    storage_type &storage() { return m_storage; }
+    const storage_type &storage() const { return m_storage; }
+    const ExpiryPolicy &expiry() const { return m_expiry; }
+
+    // stamps every write with a new version
+    template <typename... Hash>
+    entry_type &store_locked(key_arg key, value_arg value,
+                             uint64_t expires_at, Hash... h) {
+        if (m_storage.find(key, h...) == nullptr) {
+            m_eviction.make_room(m_storage, [&](const entry_type &e) {
+                if (m_on_drop) {
+                    m_on_drop(e);
+                }
+            });
+        }
+        entry_type &e = m_storage.assign(key, value, expires_at, h...);
+        e.version = ++m_version_clock;
+        return e;
+    }
+
+  private:
+    struct sweeper {
+        void start(basic_cache *owner) {
+            m_thread = std::thread([this, owner] {
+                std::unique_lock lk(m_mutex_);
+                while (!m_cv.wait_for(lk, owner->m_expiry.sweep_interval(),
+                                      [&] { return _stop; })) {
+                    lk.unlock();
+                    owner->expire();
+                    lk.lock();
+                }
+            });
+        }
+        void stop() {
+            {
+                std::lock_guard lk(m_mutex_);
+                _stop = true;
+            }
+            m_cv.notify_all();
+            m_thread.join();
+        }
+
+        std::mutex m_mutex_;
+        std::condition_variable m_cv;
+        bool _stop = false;
+        std::thread m_thread;
+    };
+    struct no_sweeper {};
+
+    storage_type m_storage;
+    mutable mutex_type m_mutex_;
+    uint64_t m_version_clock = 0;
+    ExpiryPolicy m_expiry;
+    [[no_unique_address]] EvictionPolicy m_eviction;
+    drop_fn m_on_drop;
+    [[no_unique_address]]
+    std::conditional_t<ExpiryPolicy::background, sweeper, no_sweeper>
+        m_sweeper;
+};
@@ -1,13 +1,23 @@
 #pragma once
+#include "basic_cache.h"
+#include "flat_map.h"
 #include "i_db.h"
+#include "metrics.h"
+#include "near_cache.h"
 #include "pipeline.h"
+#include "snapshot.h"
 
 #include "stdint.h"
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <iterator>
 #include <mutex>
+#include <optional>
+#include <sstream>
 #include <shared_mutex>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
@@ -17,19 +27,139 @@ template <typename T> struct cache_el {
     T data;
 };
 
+enum class write_policy {
+    through = 0,
+    back = 1,
+};
+
+struct cache_config {
+    write_policy policy = write_policy::through;
+    // write-back: flush as soon as this many keys are dirty
+    size_t max_dirty = 256;
+    // write-back: upper bound on how long a write may stay unflushed
+    std::chrono::milliseconds max_delay{100};
+    // per operation latency histograms, costs two clock reads per call
+    bool track_latency = true;
+    // when set the cache warm starts from this file and rewrites it
+    // every snapshot_interval and on shutdown
+    std::string snapshot_path;
+    std::chrono::seconds snapshot_interval{60};
+    // slots of the per thread near cache in front of the shared map,
+    // 0 turns it off
+    size_t near_slots = 0;
+};
+
+struct cache_stats {
+    enum counter : size_t {
+        hits,
+        misses,
+        // write-back: reads answered from writes not flushed yet
+        pending_hits,
+        expired,
+        upstream_gets,
+        upstream_sets,
+        upstream_removes,
+        // contended acquisitions of the map lock and time spent in them
+        lock_waits,
+        lock_wait_ns,
+        flushes,
+        flushed_keys,
+        tx_begun,
+        tx_committed,
+        tx_failed,
+        // commits refused because something the transaction read changed
+        tx_conflicts,
+        tx_aborted,
+        snapshot_saves,
+        snapshot_saved_keys,
+        snapshot_loaded_keys,
+        // reads served by the calling thread's near cache, these are not
+        // counted in hits
+        near_hits,
+        Count
+    };
+    static constexpr const char *names[Count] = {
+        "hits",          "misses",           "pending_hits",
+        "expired",       "upstream_gets",    "upstream_sets",
+        "upstream_removes", "lock_waits",    "lock_wait_ns",
+        "flushes",       "flushed_keys",     "tx_begun",
+        "tx_committed",  "tx_failed",        "tx_conflicts",
+        "tx_aborted",    "snapshot_saves",   "snapshot_saved_keys",
+        "snapshot_loaded_keys", "near_hits"};
+
+    void add(counter c, uint64_t n = 1) { counters.add(c, n); }
+    uint64_t read(counter c) const { return counters.read(c); }
+
+    sharded_counters<Count> counters;
+    sharded_histogram get_hit;
+    sharded_histogram get_miss;
+    sharded_histogram set;
+    sharded_histogram remove;
+};
+
+// entries, map lock and expiry sweeping of `cache`
+using cache_store = basic_cache<std::string, std::string, shared_lock_policy,
+                                no_eviction, ttl_expiry<>>;
+
+// Read handle returned by cache::get_ref. A hit views the bytes stored in
+// the cache and pins them by holding the cache's shared lock, so keep it
+// short lived and don't write to the same cache while holding it. Inside
+// a transaction or with the near cache on it holds a copy instead.
+struct cache_ref {
+    std::string_view value() const {
+        return m_lock.owns_lock() ? m_view : std::string_view(m_owned);
+    }
+    bool empty() const { return value().empty(); }
+    explicit operator bool() const { return !empty(); }
+
+  private:
+    friend struct cache;
+    std::shared_lock<cache_store::mutex_type> m_lock;
+    std::string_view m_view;
+    // set when the value couldn't be pinned in the cache
+    std::string m_owned;
+};
+
 struct cache : public i_db {
-    using val_type = cache_el<std::string>;
-    cache(i_db *upstream, uint64_t ttl = 12)
-        : m_upstream(upstream), m_ttl(ttl),
-          _cleanup_thread(&cache::cleanup, this), _stop_cleanup(false) {}
+    cache(i_db *upstream, uint64_t ttl = 12, cache_config cfg = {})
+        : m_id(next_id()), m_near(cfg.near_slots),
+          m_store(ttl_expiry<>{std::chrono::seconds(ttl)}, {},
+                  [this](const flat_entry &e) { on_expired(e); }),
+          m_upstream(upstream), m_ttl(ttl), m_cfg(cfg) {
+        if (m_cfg.policy == write_policy::back) {
+            _flush_thread = std::thread(&cache::flusher, this);
+        }
+        if (!m_cfg.snapshot_path.empty()) {
+            load_snapshot(m_cfg.snapshot_path);
+            _snapshot_thread = std::thread(&cache::snapshotter, this);
+        }
+    }
 
     ~cache() {
-        _stop_cleanup = true;
-        if (_cleanup_thread.joinable()) {
-            _cleanup_thread.join();
+        // transactions this thread left open, other threads' can't be reached
+        open_transactions().erase(m_id);
+        if (_snapshot_thread.joinable()) {
+            {
+                std::lock_guard lk(m_snapshot_mutex_);
+                _stop_snapshot = true;
+            }
+            m_snapshot_cv.notify_all();
+            _snapshot_thread.join();
+            save_snapshot(m_cfg.snapshot_path);
+        }
+        if (_flush_thread.joinable()) {
+            {
+                std::lock_guard lk(m_dirty_mutex_);
+                _stop_flush = true;
+            }
+            m_dirty_cv.notify_all();
+            _flush_thread.join();
+            flush();
         }
     }
 
+    // Transactions belong to the calling thread, other threads keep
+    // reading and writing the cache directly while one is open.
     bool begin_transaction() override;
     bool commit_transaction() override;
     bool abort_transaction() override;
@@ -37,125 +167,633 @@ struct cache : public i_db {
     std::string set(const std::string &key, const std::string &data) override;
     std::string remove(const std::string &key) override;
 
+    // zero copy read, see cache_ref
+    cache_ref get_ref(std::string_view key);
+
+    // write-back: blocks until every write issued before the call
+    // has reached the upstream
+    void flush();
+
+    // Writes live entries to `path` a slice of the table at a time under
+    // the shared lock, readers are never blocked and writers only briefly.
+    bool save_snapshot(const std::string &path);
+    // Bulk loads a snapshot, decoding it in parallel and skipping expired
+    // entries. Returns the number of entries loaded.
+    size_t load_snapshot(const std::string &path);
+
+    const cache_stats &stats() const { return m_stats; }
+    // counters, latency percentiles and current sizes as one JSON object
+    std::string stats_json();
+
   private:
-    void cleanup();
-    std::string _get(const std::string &key);
-    std::string _set(const std::string &key, const std::string &data);
-    std::string _remove(const std::string &key);
+    // nullopt marks a pending remove
+    using dirty_map =
+        std::unordered_map<std::string, std::optional<std::string>,
+                           string_hash, std::equal_to<>>;
+    // What the cache knew of a key when it was read: the entry version
+    // (0 when not cached) and the drop count of the key's stripe, which
+    // also moves when an absent key is set and removed again.
+    struct key_stamp {
+        uint64_t version = 0;
+        uint64_t drops = 0;
+        bool operator==(const key_stamp &) const = default;
+    };
+    // a read whose value may already be outdated, never validates
+    static constexpr key_stamp StaleStamp = {UINT64_MAX, UINT64_MAX};
+    static constexpr size_t DropStripes = 1024;
+
+    // open transaction: buffered writes (nullopt marks a remove) and the
+    // stamp of every key at its first read, checked again on commit
+    struct tx_context {
+        dirty_map writes;
+        std::unordered_map<std::string, key_stamp, string_hash,
+                           std::equal_to<>>
+            reads;
+    };
 
-    std::unordered_map<std::string, val_type> m_cache_map;
-    mutable std::shared_mutex m_mutex_;
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id = 0;
+        return ++id;
+    }
+    // the calling thread's open transactions, by cache id
+    static std::unordered_map<uint64_t, tx_context> &open_transactions() {
+        thread_local std::unordered_map<uint64_t, tx_context> txs;
+        return txs;
+    }
+    // the calling thread's transaction on this cache, nullptr if none
+    tx_context *tx() {
+        auto &txs = open_transactions();
+        if (txs.empty()) {
+            return nullptr;
+        }
+        auto it = txs.find(m_id);
+        return it == txs.end() ? nullptr : &it->second;
+    }
+
+    void flusher();
+    void snapshotter();
+    void mark_dirty(std::string_view key, std::optional<std::string_view> data);
+    std::optional<std::optional<std::string>> find_dirty(std::string_view key);
+    // `stamp` receives the key's stamp the value was read at
+    std::string _get(std::string_view key, key_stamp *stamp = nullptr);
+    std::string _set(std::string_view key, std::string_view data);
+    std::string _remove(std::string_view key);
+    std::string tx_get(tx_context &t, std::string_view key);
+    bool apply_transaction(const tx_context &t);
+
+    // the helpers below expect the map lock to be held, exclusively for
+    // store and drop, which also invalidate near cached copies
+    flat_map &map() { return m_store.storage(); }
+    const flat_map &map() const { return m_store.storage(); }
+    void store(std::string_view key, std::string_view data,
+               uint64_t expires_at) {
+        const size_t h = flat_map::hash(key);
+        m_store.store_locked(key, data, expires_at, h);
+        m_near.invalidate(h);
+    }
+    // true if the key was cached
+    bool drop(std::string_view key) {
+        const size_t h = flat_map::hash(key);
+        ++m_drops[h & (DropStripes - 1)];
+        if (!map().erase(key, h)) {
+            return false;
+        }
+        m_near.invalidate(h);
+        return true;
+    }
+    key_stamp stamp_of(std::string_view key) const {
+        const size_t h = flat_map::hash(key);
+        const flat_entry *e = map().find(key, h);
+        return {e == nullptr ? 0 : e->version, m_drops[h & (DropStripes - 1)]};
+    }
+    // called by the store's sweeper for every expired entry it drops
+    void on_expired(const flat_entry &e) {
+        const size_t h = flat_map::hash(e.key());
+        m_stats.add(cache_stats::expired);
+        ++m_drops[h & (DropStripes - 1)];
+        m_near.invalidate(h);
+    }
+
+    // map lock acquisition that accounts for contention
+    std::shared_lock<cache_store::mutex_type> read_lock();
+    std::unique_lock<cache_store::mutex_type> write_lock();
+    sharded_histogram *timed(sharded_histogram &h) {
+        return m_cfg.track_latency ? &h : nullptr;
+    }
+
+    // never reused, keys the calling thread's transaction
+    const uint64_t m_id;
+    // declared before m_store, its sweeper reports into them
+    cache_stats m_stats;
+    near_cache m_near;
+    cache_store m_store;
     i_db *m_upstream;
     uint64_t m_ttl;
+    cache_config m_cfg;
+    // bumped by every drop, even of keys that weren't cached, so fills and
+    // transactions notice removes that left no version behind
+    std::array<uint64_t, DropStripes> m_drops = {};
+    // Single upstream calls hold it shared, an upstream transaction
+    // exclusively: the upstream has one transaction state for all callers,
+    // anything reaching it meanwhile would become part of the transaction.
+    std::shared_mutex m_upstream_mutex_;
+
+    // writes not yet sent upstream, and the batch currently being sent
+    dirty_map m_dirty;
+    dirty_map m_flushing;
+    std::mutex m_dirty_mutex_;
+    std::mutex m_flush_mutex_;
+    std::condition_variable m_dirty_cv;
+    bool _stop_flush = false;
+    std::thread _flush_thread;
 
-    std::atomic<bool> _stop_cleanup;
-    std::thread _cleanup_thread;
+    std::mutex m_snapshot_mutex_;
+    std::condition_variable m_snapshot_cv;
+    bool _stop_snapshot = false;
+    std::thread _snapshot_thread;
+    // one save_snapshot at a time
+    std::mutex m_snapshot_save_mutex_;
 
-    transaction_state state;
+    // keys written by commits talking to the upstream, guarded by the map
+    // lock; other commits touching them fail as conflicts
+    std::unordered_set<std::string, string_hash, std::equal_to<>>
+        m_committing;
 };
 
 bool cache::begin_transaction() {
-    if (state == transaction_state::started ||
-        state == transaction_state::ready) {
+    if (tx() != nullptr) {
         return false;
     }
-    state = transaction_state::ready;
-    bool res = m_upstream->begin_transaction();
-    if (res == false)
-        state = transaction_state::off;
-    return res;
+    // nothing reaches the upstream before commit
+    open_transactions().try_emplace(m_id);
+    m_stats.add(cache_stats::tx_begun);
+    return true;
 }
 
 bool cache::commit_transaction() {
-    if (state == transaction_state::off ||
-        state == transaction_state::started) {
+    tx_context *t = tx();
+    if (t == nullptr) {
         return false;
     }
-    state = transaction_state::started;
+    const tx_context done = std::move(*t);
+    open_transactions().erase(m_id);
+
+    bool res = apply_transaction(done);
+    m_stats.add(res ? cache_stats::tx_committed : cache_stats::tx_failed);
+    return res;
+}
+
+// Validates the read set and publishes the write set. In write-through
+// mode the written keys are claimed under the map lock, which is then let
+// go for the upstream round trip, so cache readers and writers aren't held
+// up by it; only their upstream calls wait for the upstream transaction.
+bool cache::apply_transaction(const tx_context &t) {
+    // stamps of the written keys when they were claimed, in t.writes order
+    std::vector<key_stamp> claimed;
+    {
+        std::unique_lock lock = write_lock();
+        for (const auto &[key, stamp] : t.reads) {
+            if (stamp_of(key) != stamp || m_committing.count(key) != 0) {
+                m_stats.add(cache_stats::tx_conflicts);
+                return false;
+            }
+        }
+        for (const auto &[key, data] : t.writes) {
+            if (m_committing.count(key) != 0) {
+                m_stats.add(cache_stats::tx_conflicts);
+                return false;
+            }
+        }
+        if (t.writes.empty()) {
+            return true;
+        }
+        if (m_cfg.policy == write_policy::back) {
+            std::time_t unix_time = std::chrono::system_clock::to_time_t(
+                std::chrono::system_clock::now());
+            for (const auto &[key, data] : t.writes) {
+                if (data) {
+                    store(key, *data, unix_time + m_ttl);
+                } else {
+                    drop(key);
+                }
+                mark_dirty(key, data);
+            }
+            return true;
+        }
+        for (const auto &[key, data] : t.writes) {
+            m_committing.insert(key);
+            claimed.push_back(stamp_of(key));
+        }
+    }
 
-    bool res = m_upstream->commit_transaction();
-    state = transaction_state::off;
+    // the whole write set goes up as one upstream transaction
+    std::unique_lock upstream_lock(m_upstream_mutex_);
+    const bool begun = m_upstream->begin_transaction();
+    bool res = begun;
+    if (begun) {
+        for (const auto &[key, data] : t.writes) {
+            if (data) {
+                m_stats.add(cache_stats::upstream_sets);
+                m_upstream->set(key, *data);
+            } else {
+                m_stats.add(cache_stats::upstream_removes);
+                m_upstream->remove(key);
+            }
+        }
+        res = m_upstream->commit_transaction();
+    }
+    upstream_lock.unlock();
+
+    std::time_t unix_time =
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::unique_lock lock = write_lock();
+    auto claim = claimed.begin();
+    for (const auto &[key, data] : t.writes) {
+        // a plain write stored meanwhile may be older or newer than ours
+        // upstream, only dropping the key is right either way
+        const bool untouched = stamp_of(key) == *claim++;
+        if (res && data && untouched) {
+            store(key, *data, unix_time + m_ttl);
+        } else if (begun) {
+            // a failed commit may have applied part of it, stop trusting it
+            drop(key);
+        }
+        m_committing.erase(m_committing.find(key));
+    }
     return res;
 }
 
 bool cache::abort_transaction() {
-    if (state == transaction_state::off) {
+    if (tx() == nullptr) {
         return false;
     }
-    bool res = m_upstream->abort_transaction();
-    state = transaction_state::off;
-    return res;
+    open_transactions().erase(m_id);
+    m_stats.add(cache_stats::tx_aborted);
+    return true;
 }
 
-void cache::cleanup() {
-    while (!_stop_cleanup) {
-        std::this_thread::sleep_for(std::chrono::seconds(m_ttl * 2));
+void cache::snapshotter() {
+    std::unique_lock lk(m_snapshot_mutex_);
+    while (!m_snapshot_cv.wait_for(lk, m_cfg.snapshot_interval,
+                                   [&] { return _stop_snapshot; })) {
+        lk.unlock();
+        save_snapshot(m_cfg.snapshot_path);
+        lk.lock();
+    }
+}
 
-        std::time_t now = std::chrono::system_clock::to_time_t(
-            std::chrono::system_clock::now());
+bool cache::save_snapshot(const std::string &path) {
+    // slots scanned per shared lock acquisition
+    constexpr size_t SliceSlots = 4096;
 
-        std::unique_lock lock(m_mutex_);
-        for (auto it = m_cache_map.begin(); it != m_cache_map.end();) {
-            if (it->second.expires_at <= now) {
-                it = m_cache_map.erase(it);
-            } else {
-                ++it;
+    std::lock_guard save_lock(m_snapshot_save_mutex_);
+    snapshot_writer out(path);
+    if (!out.ok()) {
+        return false;
+    }
+    const uint64_t now =
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    for (size_t from = 0;; from += SliceSlots) {
+        bool done;
+        {
+            std::shared_lock lock = read_lock();
+            map().for_each_in(
+                from, from + SliceSlots, [&](const flat_entry &e) {
+                    if (e.expires_at > now) {
+                        out.add(e.key(), e.value(), e.expires_at);
+                    }
+                });
+            done = from + SliceSlots >= map().capacity();
+        }
+        out.drain();
+        if (done) {
+            break;
+        }
+    }
+    if (!out.commit()) {
+        return false;
+    }
+    m_stats.add(cache_stats::snapshot_saves);
+    m_stats.add(cache_stats::snapshot_saved_keys, out.entries());
+    return true;
+}
+
+size_t cache::load_snapshot(const std::string &path) {
+    snapshot_reader in(path);
+    if (!in.ok()) {
+        return 0;
+    }
+    const uint64_t now =
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    auto parts = in.load(now, std::thread::hardware_concurrency());
+
+    size_t total = 0;
+    for (const auto &part : parts) {
+        total += part.size();
+    }
+    std::unique_lock lock = write_lock();
+    map().reserve(map().size() + total);
+    for (const auto &part : parts) {
+        for (const snapshot_record &rec : part) {
+            m_store.store_locked(rec.key, rec.value, rec.expires_at,
+                                 rec.hash);
+            m_near.invalidate(rec.hash);
+        }
+    }
+    m_stats.add(cache_stats::snapshot_loaded_keys, total);
+    return total;
+}
+
+void cache::flusher() {
+    std::unique_lock lk(m_dirty_mutex_);
+    while (!_stop_flush) {
+        m_dirty_cv.wait_for(lk, m_cfg.max_delay, [&] {
+            return _stop_flush || m_dirty.size() >= m_cfg.max_dirty;
+        });
+        if (_stop_flush || m_dirty.empty()) {
+            continue;
+        }
+        lk.unlock();
+        flush();
+        lk.lock();
+    }
+}
+
+void cache::flush() {
+    if (m_cfg.policy != write_policy::back) {
+        return;
+    }
+    // serializes flushers, so a flush() racing the background thread
+    // still waits for the batch that thread already took
+    std::lock_guard flush_lock(m_flush_mutex_);
+    {
+        std::lock_guard lk(m_dirty_mutex_);
+        if (m_dirty.empty()) {
+            return;
+        }
+        m_flushing.swap(m_dirty);
+    }
+
+    dirty_map failed;
+    std::shared_lock upstream_lock(m_upstream_mutex_);
+    for (auto &[key, data] : m_flushing) {
+        if (data) {
+            m_stats.add(cache_stats::upstream_sets);
+            if (m_upstream->set(key, *data) == "") {
+                // find_dirty may be copying it right now
+                failed.emplace(key, data);
+            }
+        } else {
+            // "" only means the upstream never had the key
+            m_stats.add(cache_stats::upstream_removes);
+            m_upstream->remove(key);
+        }
+    }
+    upstream_lock.unlock();
+    m_stats.add(cache_stats::flushes);
+    m_stats.add(cache_stats::flushed_keys, m_flushing.size());
+
+    std::lock_guard lk(m_dirty_mutex_);
+    m_flushing.clear();
+    // retry on the next round unless the key got overwritten meanwhile
+    for (auto &[key, data] : failed) {
+        m_dirty.try_emplace(key, std::move(data));
+    }
+}
+
+void cache::mark_dirty(std::string_view key,
+                       std::optional<std::string_view> data) {
+    size_t dirty_count;
+    {
+        std::lock_guard lk(m_dirty_mutex_);
+        auto it = m_dirty.find(key);
+        if (it == m_dirty.end()) {
+            it = m_dirty.emplace(std::string(key), std::nullopt).first;
+        }
+        // reuses the old value's buffer on overwrite
+        if (data) {
+            if (!it->second) {
+                it->second.emplace();
             }
+            it->second->assign(data->data(), data->size());
+        } else {
+            it->second.reset();
         }
+        dirty_count = m_dirty.size();
+    }
+    if (dirty_count >= m_cfg.max_dirty) {
+        m_dirty_cv.notify_one();
+    }
+}
+
+// outer optional: whether the key has a pending write at all,
+// inner one: the pending value, nullopt for a pending remove
+std::optional<std::optional<std::string>>
+cache::find_dirty(std::string_view key) {
+    if (m_cfg.policy != write_policy::back) {
+        return std::nullopt;
+    }
+    std::lock_guard lk(m_dirty_mutex_);
+    if (auto it = m_dirty.find(key); it != m_dirty.end()) {
+        return it->second;
+    }
+    if (auto it = m_flushing.find(key); it != m_flushing.end()) {
+        return it->second;
     }
+    return std::nullopt;
 }
 
 std::string cache::get(const std::string &key) {
-    if (state == transaction_state::ready) {
-        m_upstream->get(key);
-        return "ok";
+    if (tx_context *t = tx()) {
+        return tx_get(*t, key);
     } else {
         return _get(key);
     }
 }
 
-std::string cache::_get(const std::string &key) {
-    m_mutex_.lock_shared();
-    auto val = m_cache_map.find(key);
-    m_mutex_.unlock_shared();
+// pending writes of the transaction, then the cache, then the upstream
+std::string cache::tx_get(tx_context &t, std::string_view key) {
+    if (auto it = t.writes.find(key); it != t.writes.end()) {
+        return it->second.value_or("");
+    }
+    key_stamp stamp;
+    std::string res = _get(key, &stamp);
+    if (t.reads.find(key) == t.reads.end()) {
+        t.reads.emplace(std::string(key), stamp);
+    }
+    return res;
+}
 
-    auto now = std::chrono::system_clock::now();
+cache_ref cache::get_ref(std::string_view key) {
+    cache_ref ref;
+    if (tx_context *t = tx()) {
+        ref.m_owned = tx_get(*t, key);
+        return ref;
+    }
+    // the near cache hands out copies, so do reads going through it
+    if (m_near.enabled()) {
+        ref.m_owned = _get(key);
+        return ref;
+    }
+
+    scoped_timer timer(timed(m_stats.get_hit));
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        std::time_t unix_time = std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now());
+        std::shared_lock lock = read_lock();
+        const flat_entry *e = map().find(key);
+        if (e != nullptr && e->expires_at > unix_time) {
+            if (attempt == 0) {
+                m_stats.add(cache_stats::hits);
+            }
+            ref.m_view = e->value();
+            ref.m_lock = std::move(lock);
+            return ref;
+        }
+        lock.unlock();
+
+        if (attempt == 0) {
+            // _get accounts for the rest
+            timer.retarget(nullptr);
+            // fills the cache on success
+            ref.m_owned = _get(key);
+            if (ref.m_owned == "") {
+                return ref;
+            }
+        }
+    }
+    // only served from pending writes or evicted right after the fill
+    return ref;
+}
+
+std::string cache::_get(std::string_view key, key_stamp *stamp) {
+    scoped_timer timer(timed(m_stats.get_hit));
     std::time_t unix_time =
         std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 
-    // valid cache element!
-    if (val != m_cache_map.end()) {
-        const val_type &v = val->second;
+    // transactional reads need the key's stamp, the near cache has none
+    const bool near = m_near.enabled() && stamp == nullptr;
+    const size_t h = flat_map::hash(key);
+    if (near) {
+        if (const std::string *v = m_near.find(key, h, unix_time)) {
+            m_stats.add(cache_stats::near_hits);
+            return *v;
+        }
+    }
 
-        if (v.expires_at > unix_time) {
-            return val->second.data;
+    {
+        std::shared_lock lock = read_lock();
+        const flat_entry *e = map().find(key, h);
+        // valid cache element!
+        if (e != nullptr && e->expires_at > unix_time) {
+            m_stats.add(cache_stats::hits);
+            if (stamp != nullptr) {
+                *stamp = {e->version, m_drops[h & (DropStripes - 1)]};
+            }
+            std::string res(e->value());
+            if (near) {
+                const uint64_t expires_at = e->expires_at;
+                const uint64_t stamp = m_near.stamp_of(h);
+                lock.unlock();
+                m_near.offer(key, res, expires_at, h, stamp, unix_time);
+            }
+            return res;
         }
     }
-    std::string resp = m_upstream->get(key);
-    if (resp == "") {
-        std::unique_lock lock(m_mutex_);
-        m_cache_map.erase(key);
-        return resp;
+
+    // write-back: an expired entry may still be newer than the upstream
+    if (auto pending = find_dirty(key)) {
+        m_stats.add(cache_stats::pending_hits);
+        if (stamp != nullptr) {
+            std::shared_lock lock = read_lock();
+            *stamp = stamp_of(key);
+        }
+        return pending->value_or("");
     }
 
+    timer.retarget(timed(m_stats.get_miss));
+    m_stats.add(cache_stats::misses);
+    // what the fill below must find unchanged to store the upstream's answer
+    key_stamp seen;
+    {
+        std::shared_lock lock = read_lock();
+        seen = stamp_of(key);
+    }
+    m_stats.add(cache_stats::upstream_gets);
+    std::string resp;
+    {
+        std::shared_lock upstream_lock(m_upstream_mutex_);
+        resp = m_upstream->get(std::string(key));
+    }
     unix_time =
         std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 
-    m_cache_map[key] = val_type{unix_time + m_ttl, resp};
+    std::unique_lock lock = write_lock();
+    // a write may have landed while we were talking to the upstream
+    if (auto pending = find_dirty(key)) {
+        if (stamp != nullptr) {
+            *stamp = stamp_of(key);
+        }
+        return pending->value_or("");
+    }
+    // or already been flushed, then `resp` may predate it: answer with it
+    // but don't cache it, and make a transaction that read it fail
+    if (stamp_of(key) != seen) {
+        if (stamp != nullptr) {
+            *stamp = StaleStamp;
+        }
+        return resp;
+    }
+    if (resp == "") {
+        drop(key);
+    } else {
+        store(key, resp, unix_time + m_ttl);
+    }
+    if (stamp != nullptr) {
+        *stamp = stamp_of(key);
+    }
     return resp;
 }
 
 std::string cache::set(const std::string &key, const std::string &data) {
-    if (state == transaction_state::ready) {
-        m_upstream->set(key, data);
-        return "ok";
+    if (tx_context *t = tx()) {
+        if (data == "") {
+            return data;
+        }
+        t->writes.insert_or_assign(key, data);
+        return data;
     } else {
         return _set(key, data);
     }
 }
 
-std::string cache::_set(const std::string &key, const std::string &data) {
-    std::string resp = m_upstream->set(key, data);
+std::string cache::_set(std::string_view key, std::string_view data) {
+    scoped_timer timer(timed(m_stats.set));
+    if (m_cfg.policy == write_policy::back) {
+        // "" is how the upstream reports a miss, so it can't be stored
+        if (data == "") {
+            return "";
+        }
+        std::time_t unix_time = std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now());
+
+        std::unique_lock lock = write_lock();
+        store(key, data, unix_time + m_ttl);
+        mark_dirty(key, data);
+        return std::string(data);
+    }
+
+    key_stamp seen;
+    {
+        std::shared_lock lock = read_lock();
+        seen = stamp_of(key);
+    }
+    m_stats.add(cache_stats::upstream_sets);
+    std::string resp;
+    {
+        std::shared_lock upstream_lock(m_upstream_mutex_);
+        resp = m_upstream->set(std::string(key), std::string(data));
+    }
     if (resp == "") {
         return resp;
     }
@@ -163,26 +801,107 @@ std::string cache::_set(const std::string &key, const std::string &data) {
     std::time_t unix_time =
         std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 
-    std::unique_lock lock(m_mutex_);
-    m_cache_map[key] = val_type{unix_time + m_ttl, resp};
+    std::unique_lock lock = write_lock();
+    // another write to the key may have reached the upstream after ours
+    if (stamp_of(key) == seen) {
+        store(key, resp, unix_time + m_ttl);
+    } else {
+        drop(key);
+    }
     return resp;
 }
 
 std::string cache::remove(const std::string &key) {
-    if (state == transaction_state::ready) {
-        m_upstream->remove(key);
+    if (tx_context *t = tx()) {
+        t->writes.insert_or_assign(key, std::nullopt);
         return "ok";
     } else {
         return _remove(key);
     }
 }
 
-std::string cache::_remove(const std::string &key) {
-    std::string resp = m_upstream->remove(key);
+std::string cache::_remove(std::string_view key) {
+    scoped_timer timer(timed(m_stats.remove));
+    if (m_cfg.policy == write_policy::back) {
+        std::unique_lock lock = write_lock();
+        const bool cached = drop(key);
+        const auto pending = find_dirty(key);
+        if (cached || (pending && *pending)) {
+            mark_dirty(key, std::nullopt);
+            return "ok";
+        }
+        if (pending) {
+            // already removed, just not flushed yet
+            return "";
+        }
+        // nothing known about the key here, only the upstream can tell
+        // whether it exists, as in write-through mode
+    }
+
+    m_stats.add(cache_stats::upstream_removes);
+    std::string resp;
+    {
+        std::shared_lock upstream_lock(m_upstream_mutex_);
+        resp = m_upstream->remove(std::string(key));
+    }
     if (resp == "") {
         return resp;
     }
-    std::unique_lock lock(m_mutex_);
-    m_cache_map.erase(key);
+    std::unique_lock lock = write_lock();
+    drop(key);
     return resp;
-}
\ No newline at end of file
+}
+
+std::shared_lock<cache_store::mutex_type> cache::read_lock() {
+    std::shared_lock lock(m_store.mutex(), std::try_to_lock);
+    if (!lock.owns_lock()) {
+        auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        m_stats.add(cache_stats::lock_waits);
+        m_stats.add(cache_stats::lock_wait_ns,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+    }
+    return lock;
+}
+
+std::unique_lock<cache_store::mutex_type> cache::write_lock() {
+    std::unique_lock lock(m_store.mutex(), std::try_to_lock);
+    if (!lock.owns_lock()) {
+        auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        m_stats.add(cache_stats::lock_waits);
+        m_stats.add(cache_stats::lock_wait_ns,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+    }
+    return lock;
+}
+
+std::string cache::stats_json() {
+    const size_t entries = m_store.size();
+    size_t dirty;
+    {
+        std::lock_guard lk(m_dirty_mutex_);
+        dirty = m_dirty.size() + m_flushing.size();
+    }
+
+    std::ostringstream os;
+    os << "{\"entries\": " << entries << ", \"dirty\": " << dirty;
+    for (size_t c = 0; c < cache_stats::Count; ++c) {
+        os << ", \"" << cache_stats::names[c]
+           << "\": " << m_stats.read(cache_stats::counter(c));
+    }
+    os << ", \"latency\": {\"get_hit\": ";
+    histogram_json(os, m_stats.get_hit);
+    os << ", \"get_miss\": ";
+    histogram_json(os, m_stats.get_miss);
+    os << ", \"set\": ";
+    histogram_json(os, m_stats.set);
+    os << ", \"remove\": ";
+    histogram_json(os, m_stats.remove);
+    os << "}}";
+    return os.str();
+}
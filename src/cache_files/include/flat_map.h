@@ -0,0 +1,390 @@
+#pragma once
+#include "stdint.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// transparent hash, lets std containers keyed by std::string
+// be probed with a std::string_view without building a temporary
+struct string_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view sv) const {
+        return std::hash<std::string_view>{}(sv);
+    }
+};
+
+// Hands out blocks from power-of-two size classes carved out of big chunks.
+// Freed blocks go to a per-class free list and are reused as is,
+// so steady state inserts/overwrites never reach the system allocator.
+struct slab_arena {
+    static constexpr uint8_t MinShift = 4;  // 16 bytes
+    static constexpr uint8_t MaxShift = 16; // 64 KiB
+    static constexpr uint8_t LargeClass = 0xFF;
+    static constexpr size_t ChunkSize = 1 << 20;
+
+    slab_arena() = default;
+    slab_arena(const slab_arena &) = delete;
+    slab_arena &operator=(const slab_arena &) = delete;
+    ~slab_arena() { release(); }
+
+    static uint8_t class_of(size_t size) {
+        if (size > (size_t(1) << MaxShift)) {
+            return LargeClass;
+        }
+        size_t rounded = std::bit_ceil(size < 16 ? size_t(16) : size);
+        return std::countr_zero(rounded) - MinShift;
+    }
+    static size_t capacity(uint8_t cls) {
+        return cls == LargeClass ? 0 : size_t(1) << (cls + MinShift);
+    }
+
+    char *alloc(size_t size, uint8_t &cls) {
+        cls = class_of(size);
+        if (cls == LargeClass) {
+            return new char[size];
+        }
+        if (free_list[cls] != nullptr) {
+            char *p = free_list[cls];
+            std::memcpy(&free_list[cls], p, sizeof(char *));
+            return p;
+        }
+        const size_t cap = capacity(cls);
+        if (chunks.empty() || chunk_used + cap > ChunkSize) {
+            chunks.push_back(new char[ChunkSize]);
+            chunk_used = 0;
+        }
+        char *p = chunks.back() + chunk_used;
+        chunk_used += cap;
+        return p;
+    }
+
+    void free(char *p, uint8_t cls) {
+        if (cls == LargeClass) {
+            delete[] p;
+            return;
+        }
+        // the block itself stores the next free block
+        std::memcpy(p, &free_list[cls], sizeof(char *));
+        free_list[cls] = p;
+    }
+
+    void release() {
+        for (char *c : chunks) {
+            delete[] c;
+        }
+        chunks.clear();
+        chunk_used = 0;
+        std::memset(free_list, 0, sizeof(free_list));
+    }
+
+  private:
+    std::vector<char *> chunks;
+    size_t chunk_used = 0;
+    char *free_list[MaxShift - MinShift + 1] = {};
+};
+
+// key and value bytes live back to back in one arena block
+struct flat_entry {
+    uint64_t expires_at;
+    // left to the owner, e.g. bumped on every write for change detection
+    uint64_t version;
+    char *block;
+    uint32_t key_len;
+    uint32_t val_len;
+    uint8_t cls;
+
+    std::string_view key() const { return {block, key_len}; }
+    std::string_view value() const { return {block + key_len, val_len}; }
+};
+
+// Open addressing table in the spirit of Swiss tables: one control byte per
+// slot holds either a state or 7 bits of the key hash, a probe compares
+// 16 control bytes at once and touches slots only on a tag match.
+struct flat_map {
+    using entry_type = flat_entry;
+
+    flat_map() = default;
+    flat_map(const flat_map &) = delete;
+    flat_map &operator=(const flat_map &) = delete;
+    ~flat_map() {
+        clear();
+        deallocate();
+    }
+
+    size_t size() const { return m_size; }
+
+    flat_entry *find(std::string_view key) {
+        return find(key, hash(key));
+    }
+    const flat_entry *find(std::string_view key) const {
+        return find(key, hash(key));
+    }
+    const flat_entry *find(std::string_view key, size_t h) const {
+        return const_cast<flat_map *>(this)->find(key, h);
+    }
+
+    flat_entry *find(std::string_view key, size_t h) {
+        if (m_capacity == 0) {
+            return nullptr;
+        }
+        const int8_t tag = h2(h);
+        const size_t mask = m_capacity / GroupWidth - 1;
+        size_t g = h1(h) & mask;
+        for (size_t i = 1;; ++i) {
+            group grp(m_ctrl + g * GroupWidth);
+            for (uint32_t m = grp.match(tag); m != 0; m &= m - 1) {
+                flat_entry &e = m_slots[g * GroupWidth + std::countr_zero(m)];
+                if (e.key_len == key.size() &&
+                    std::memcmp(e.block, key.data(), key.size()) == 0) {
+                    return &e;
+                }
+            }
+            if (grp.match_empty() != 0) {
+                return nullptr;
+            }
+            g = (g + i) & mask;
+        }
+    }
+
+    // inserts or overwrites; an overwrite that fits the old block
+    // is done in place
+    flat_entry &assign(std::string_view key, std::string_view value,
+                       uint64_t expires_at) {
+        return assign(key, value, expires_at, hash(key));
+    }
+
+    flat_entry &assign(std::string_view key, std::string_view value,
+                       uint64_t expires_at, size_t h) {
+        if (flat_entry *e = find(key, h)) {
+            const size_t need = key.size() + value.size();
+            if (need > slab_arena::capacity(e->cls)) {
+                uint8_t cls;
+                char *block = m_arena.alloc(need, cls);
+                std::memcpy(block, key.data(), key.size());
+                m_arena.free(e->block, e->cls);
+                e->block = block;
+                e->cls = cls;
+            }
+            std::memcpy(e->block + e->key_len, value.data(), value.size());
+            e->val_len = value.size();
+            e->expires_at = expires_at;
+            return *e;
+        }
+
+        if (m_capacity == 0) {
+            rehash(GroupWidth);
+        }
+        size_t idx = find_insert_slot(h);
+        if (m_growth_left == 0 && m_ctrl[idx] == Empty) {
+            rehash(grow_target());
+            idx = find_insert_slot(h);
+        }
+        if (m_ctrl[idx] == Empty) {
+            --m_growth_left;
+        }
+        m_ctrl[idx] = h2(h);
+        ++m_size;
+
+        flat_entry &e = m_slots[idx];
+        e.block = m_arena.alloc(key.size() + value.size(), e.cls);
+        std::memcpy(e.block, key.data(), key.size());
+        std::memcpy(e.block + key.size(), value.data(), value.size());
+        e.key_len = key.size();
+        e.val_len = value.size();
+        e.expires_at = expires_at;
+        return e;
+    }
+
+    bool erase(std::string_view key) { return erase(key, hash(key)); }
+    bool erase(std::string_view key, size_t h) {
+        flat_entry *e = find(key, h);
+        if (e == nullptr) {
+            return false;
+        }
+        erase_slot(e - m_slots);
+        return true;
+    }
+
+    // `e` must be an entry of this map
+    void erase_entry(const flat_entry &e) { erase_slot(&e - m_slots); }
+
+    template <typename Pred> size_t erase_if(Pred pred) {
+        size_t erased = 0;
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_ctrl[i] >= 0 && pred(m_slots[i])) {
+                erase_slot(i);
+                ++erased;
+            }
+        }
+        return erased;
+    }
+
+    template <typename F> void for_each(F f) const {
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_ctrl[i] >= 0) {
+                f(m_slots[i]);
+            }
+        }
+    }
+
+    // slot range scan, lets a caller walk the table in pieces;
+    // entries moved by a rehash in between may be seen twice or missed
+    size_t capacity() const { return m_capacity; }
+    template <typename F> void for_each_in(size_t from, size_t to, F f) const {
+        to = std::min(to, m_capacity);
+        for (size_t i = from; i < to; ++i) {
+            if (m_ctrl[i] >= 0) {
+                f(m_slots[i]);
+            }
+        }
+    }
+
+    void reserve(size_t n) {
+        size_t cap = GroupWidth;
+        while (cap * 7 / 8 < n) {
+            cap *= 2;
+        }
+        if (cap > m_capacity) {
+            rehash(cap);
+        }
+    }
+
+    void clear() {
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_ctrl[i] >= 0) {
+                m_arena.free(m_slots[i].block, m_slots[i].cls);
+            }
+            m_ctrl[i] = Empty;
+        }
+        m_size = 0;
+        m_growth_left = m_capacity * 7 / 8;
+    }
+
+    static size_t hash(std::string_view key) { return string_hash{}(key); }
+
+  private:
+    static constexpr size_t GroupWidth = 16;
+    static constexpr int8_t Empty = -128;
+    static constexpr int8_t Deleted = -2;
+
+    static size_t h1(size_t h) { return h >> 7; }
+    static int8_t h2(size_t h) { return h & 0x7F; }
+
+    struct group {
+        explicit group(const int8_t *p) : ctrl(p) {}
+#if defined(__SSE2__)
+        uint32_t match(int8_t tag) const {
+            __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(ctrl));
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), v));
+        }
+        uint32_t match_empty() const { return match(Empty); }
+        uint32_t match_free() const {
+            // Empty and Deleted are the only states below -1
+            __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(ctrl));
+            return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), v));
+        }
+#else
+        uint32_t match(int8_t tag) const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < GroupWidth; ++i) {
+                m |= uint32_t(ctrl[i] == tag) << i;
+            }
+            return m;
+        }
+        uint32_t match_empty() const { return match(Empty); }
+        uint32_t match_free() const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < GroupWidth; ++i) {
+                m |= uint32_t(ctrl[i] < -1) << i;
+            }
+            return m;
+        }
+#endif
+        const int8_t *ctrl;
+    };
+
+    size_t find_insert_slot(size_t h) const {
+        const size_t mask = m_capacity / GroupWidth - 1;
+        size_t g = h1(h) & mask;
+        for (size_t i = 1;; ++i) {
+            uint32_t m = group(m_ctrl + g * GroupWidth).match_free();
+            if (m != 0) {
+                return g * GroupWidth + std::countr_zero(m);
+            }
+            g = (g + i) & mask;
+        }
+    }
+
+    void erase_slot(size_t idx) {
+        m_arena.free(m_slots[idx].block, m_slots[idx].cls);
+        // probes are group aligned: a group that still has an empty slot
+        // ends every probe passing through it, no tombstone needed
+        const size_t g = idx / GroupWidth * GroupWidth;
+        if (group(m_ctrl + g).match_empty() != 0) {
+            m_ctrl[idx] = Empty;
+            ++m_growth_left;
+        } else {
+            m_ctrl[idx] = Deleted;
+        }
+        --m_size;
+    }
+
+    // tombstone heavy tables are rebuilt at the same size
+    size_t grow_target() const {
+        return m_size * 2 < m_capacity * 7 / 8 ? m_capacity : m_capacity * 2;
+    }
+
+    void rehash(size_t new_capacity) {
+        int8_t *old_ctrl = m_ctrl;
+        flat_entry *old_slots = m_slots;
+        const size_t old_capacity = m_capacity;
+
+        m_ctrl = static_cast<int8_t *>(
+            ::operator new(new_capacity, std::align_val_t(GroupWidth)));
+        m_slots = static_cast<flat_entry *>(
+            ::operator new(new_capacity * sizeof(flat_entry)));
+        std::memset(m_ctrl, Empty, new_capacity);
+        m_capacity = new_capacity;
+        m_growth_left = new_capacity * 7 / 8 - m_size;
+
+        // entries keep their arena blocks, only the slots move
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_ctrl[i] >= 0) {
+                const size_t h = hash(old_slots[i].key());
+                const size_t idx = find_insert_slot(h);
+                m_ctrl[idx] = h2(h);
+                m_slots[idx] = old_slots[i];
+            }
+        }
+        if (old_ctrl != nullptr) {
+            ::operator delete(old_ctrl, std::align_val_t(GroupWidth));
+            ::operator delete(old_slots);
+        }
+    }
+
+    void deallocate() {
+        if (m_ctrl != nullptr) {
+            ::operator delete(m_ctrl, std::align_val_t(GroupWidth));
+            ::operator delete(m_slots);
+        }
+        m_ctrl = nullptr;
+        m_slots = nullptr;
+        m_capacity = 0;
+    }
+
+    int8_t *m_ctrl = nullptr;
+    flat_entry *m_slots = nullptr;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+    size_t m_growth_left = 0;
+    slab_arena m_arena;
+};
@@ -0,0 +1,102 @@
+#pragma once
+#include "stdint.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+
+// HDR style histogram: values below 64 get exact buckets, above that every
+// power of two is split into 32 linear sub-buckets (~3% relative error).
+// Buckets are relaxed atomics so concurrent record() calls are safe;
+// readers see a consistent enough picture for reporting.
+struct latency_histogram {
+    static constexpr int SubBits = 5;
+    static constexpr uint64_t SubCount = 1 << SubBits;
+    // exact buckets, then one row per power of two from 2^(SubBits + 1)
+    // up to 2^63
+    static constexpr size_t BucketCount = (64 - SubBits + 1) * SubCount;
+
+    void record(uint64_t v) {
+        m_buckets[index_of(v)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t cur = m_max.load(std::memory_order_relaxed);
+        while (v > cur && !m_max.compare_exchange_weak(
+                              cur, v, std::memory_order_relaxed)) {
+        }
+    }
+
+    void merge(const latency_histogram &other) {
+        for (size_t i = 0; i < BucketCount; ++i) {
+            uint64_t n = other.m_buckets[i].load(std::memory_order_relaxed);
+            if (n != 0) {
+                m_buckets[i].fetch_add(n, std::memory_order_relaxed);
+            }
+        }
+        m_count.fetch_add(other.count(), std::memory_order_relaxed);
+        m_sum.fetch_add(other.m_sum.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+        uint64_t other_max = other.max();
+        uint64_t cur = m_max.load(std::memory_order_relaxed);
+        while (other_max > cur && !m_max.compare_exchange_weak(
+                                      cur, other_max,
+                                      std::memory_order_relaxed)) {
+        }
+    }
+
+    void reset() {
+        for (auto &b : m_buckets) {
+            b.store(0, std::memory_order_relaxed);
+        }
+        m_count = 0;
+        m_sum = 0;
+        m_max = 0;
+    }
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+    double mean() const {
+        uint64_t n = count();
+        return n == 0 ? 0.0 : double(m_sum.load(std::memory_order_relaxed)) / n;
+    }
+
+    // value at quantile q (0..1), reported as the middle of its bucket
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, uint64_t(q * n + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BucketCount; ++i) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(lower_bound(i) + width(i) / 2, max());
+            }
+        }
+        return max();
+    }
+
+  private:
+    static size_t index_of(uint64_t v) {
+        if (v < 2 * SubCount) {
+            return v;
+        }
+        const int shift = std::bit_width(v) - 1 - SubBits;
+        return (shift + 1) * SubCount + ((v >> shift) - SubCount);
+    }
+    static uint64_t lower_bound(size_t idx) {
+        if (idx < 2 * SubCount) {
+            return idx;
+        }
+        const int shift = idx / SubCount - 1;
+        return (idx % SubCount + SubCount) << shift;
+    }
+    static uint64_t width(size_t idx) {
+        return idx < 2 * SubCount ? 1 : uint64_t(1) << (idx / SubCount - 1);
+    }
+
+    std::atomic<uint64_t> m_buckets[BucketCount] = {};
+    std::atomic<uint64_t> m_count = 0;
+    std::atomic<uint64_t> m_sum = 0;
+    std::atomic<uint64_t> m_max = 0;
+};
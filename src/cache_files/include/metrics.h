@@ -0,0 +1,153 @@
+#pragma once
+#include "histogram.h"
+
+#include "stdint.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// Each thread is pinned to one of a few shards on first use
+inline size_t metrics_shard(size_t shards) {
+    static std::atomic<size_t> next = 0;
+    thread_local size_t idx = next.fetch_add(1, std::memory_order_relaxed);
+    return idx % shards;
+}
+
+// N counters striped over cache line aligned shards, so threads bumping
+// the same counter don't fight over one line. Summed on read.
+template <size_t N> struct sharded_counters {
+    static constexpr size_t Shards = 16;
+
+    void add(size_t counter, uint64_t n = 1) {
+        m_shards[metrics_shard(Shards)].v[counter].fetch_add(
+            n, std::memory_order_relaxed);
+    }
+    uint64_t read(size_t counter) const {
+        uint64_t sum = 0;
+        for (const auto &s : m_shards) {
+            sum += s.v[counter].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+  private:
+    struct alignas(64) shard {
+        std::atomic<uint64_t> v[N] = {};
+    };
+    shard m_shards[Shards];
+};
+
+// latency_histogram striped the same way
+struct sharded_histogram {
+    static constexpr size_t Shards = 4;
+
+    void record(uint64_t v) { m_shards[metrics_shard(Shards)].record(v); }
+    void merge_into(latency_histogram &h) const {
+        for (const auto &s : m_shards) {
+            h.merge(s);
+        }
+    }
+
+  private:
+    latency_histogram m_shards[Shards];
+};
+
+// Records the time between construction and destruction into a histogram,
+// does nothing when given nullptr
+struct scoped_timer {
+    explicit scoped_timer(sharded_histogram *h) : m_hist(h) {
+        if (m_hist != nullptr) {
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+    ~scoped_timer() {
+        if (m_hist != nullptr) {
+            m_hist->record(elapsed_ns());
+        }
+    }
+    // redirect the sample, e.g. once a read turned out to be a miss
+    void retarget(sharded_histogram *h) {
+        if (m_hist != nullptr) {
+            m_hist = h;
+        }
+    }
+    uint64_t elapsed_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - m_start)
+            .count();
+    }
+
+  private:
+    sharded_histogram *m_hist;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+inline void histogram_json(std::ostream &os, const latency_histogram &h) {
+    os << "{\"count\": " << h.count() << ", \"mean_ns\": " << uint64_t(h.mean())
+       << ", \"p50_ns\": " << h.percentile(0.50)
+       << ", \"p99_ns\": " << h.percentile(0.99)
+       << ", \"p999_ns\": " << h.percentile(0.999)
+       << ", \"max_ns\": " << h.max() << "}";
+}
+
+inline void histogram_json(std::ostream &os, const sharded_histogram &h) {
+    auto merged = std::make_unique<latency_histogram>();
+    h.merge_into(*merged);
+    histogram_json(os, *merged);
+}
+
+// Periodically writes whatever `snapshot` returns to `path`. The file is
+// replaced atomically, readers never see a half written snapshot.
+struct stats_reporter {
+    stats_reporter(std::string path, std::chrono::milliseconds interval,
+                   std::function<std::string()> snapshot)
+        : m_path(std::move(path)), m_interval(interval),
+          m_snapshot(std::move(snapshot)),
+          _thread(&stats_reporter::run, this) {}
+
+    ~stats_reporter() {
+        {
+            std::lock_guard lk(m_mutex_);
+            _stop = true;
+        }
+        m_cv.notify_all();
+        _thread.join();
+        write();
+    }
+
+    bool write() {
+        const std::string tmp = m_path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << m_snapshot();
+            if (!out) {
+                return false;
+            }
+        }
+        return std::rename(tmp.c_str(), m_path.c_str()) == 0;
+    }
+
+  private:
+    void run() {
+        std::unique_lock lk(m_mutex_);
+        while (!m_cv.wait_for(lk, m_interval, [&] { return _stop; })) {
+            write();
+        }
+    }
+
+    std::string m_path;
+    std::chrono::milliseconds m_interval;
+    std::function<std::string()> m_snapshot;
+    std::mutex m_mutex_;
+    std::condition_variable m_cv;
+    bool _stop = false;
+    std::thread _thread;
+};
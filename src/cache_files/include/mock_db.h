@@ -1,13 +1,35 @@
 #pragma once
+#include "flat_map.h"
 #include "i_db.h"
+#include "metrics.h"
 #include "pipeline.h"
+#include "wal.h"
 
 #include <algorithm>
+#include <deque>
+#include <memory>
+#include <optional>
 #include <shared_mutex>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 struct mock_db : public i_db {
+    mock_db() = default;
+    // Durable variant: replays the log at cfg.path, then logs every write.
+    // Writes and commits return once their frame is on disk. Check ok()
+    // after construction, the log may not open.
+    //
+    // Changes are applied in memory before their frame is written. If that
+    // write fails, every change not on disk yet is rolled back and reported
+    // as failed (readers may have seen it meanwhile). The log stays failed,
+    // later writes and commits are refused without touching memory.
+    explicit mock_db(wal_config cfg);
+
+    // false if the write-ahead log couldn't be opened or written
+    bool ok() const { return m_wal == nullptr || m_wal->ok(); }
 
     bool begin_transaction() override;
     bool commit_transaction() override;
@@ -18,16 +40,89 @@ struct mock_db : public i_db {
 
     void set_policy(Pipeline::fail_policy fp) { pl.set_fail_policy(fp); }
 
+    // call counters and transaction outcomes as one JSON object
+    std::string stats_json();
+
   private:
-    std::string _get(const std::string &key);
-    std::string _set(const std::string &key, const std::string &data);
-    std::string _remove(const std::string &key);
+    enum counter : size_t {
+        gets,
+        sets,
+        removes,
+        tx_committed,
+        tx_failed,
+        tx_aborted,
+        CounterCount
+    };
+
+    std::string _get(std::string_view key);
+    // pipeline ops, with a log their records go to the commit's frame
+    std::string _set(std::string_view key, std::string_view data) {
+        return apply(wal_op::set, key, data, nullptr);
+    }
+    std::string _remove(std::string_view key) {
+        return apply(wal_op::remove, key, {}, nullptr);
+    }
+    // Changes vals and logs the change under the same lock, so the log
+    // order is the order writes took effect. With `ticket` the record is
+    // queued as a frame of its own, else added to m_tx_log.
+    std::string apply(wal_op op, std::string_view key, std::string_view data,
+                      uint64_t *ticket);
+    // a write outside of a transaction, durable once it returns
+    std::string write(wal_op op, std::string_view key, std::string_view data);
+    // undoes every logged change that isn't durable, newest first
+    void rollback_undurable();
+
     mutable std::shared_mutex m_mutex_;
     std::vector<std::pair<std::string, std::string>> vals;
     Pipeline pl;
-    transaction_state state;
+    sharded_counters<CounterCount> m_stats;
+    transaction_state state = transaction_state::off;
+
+    std::unique_ptr<write_ahead_log> m_wal;
+    // records of the committing transaction, guarded by m_mutex_
+    wal_batch m_tx_log;
+    wal_batch m_op_log;
+    // How to undo a logged change, kept until its frame is durable. The
+    // ticket is PendingTicket until the commit queues the frame.
+    struct undo_record {
+        uint64_t ticket;
+        std::string key;
+        // nullopt: the key didn't exist
+        std::optional<std::string> prev;
+    };
+    static constexpr uint64_t PendingTicket = UINT64_MAX;
+    // in ticket order, guarded by m_mutex_
+    std::deque<undo_record> m_undo;
+    // held shared by logged writes and exclusively by a logged commit,
+    // so no single write lands between a transaction's changes and its frame
+    std::shared_mutex m_commit_gate_;
+    uint64_t m_replayed = 0;
 };
 
+mock_db::mock_db(wal_config cfg) {
+    const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    // each partition owns a disjoint set of keys
+    std::vector<std::unordered_map<std::string, std::string, string_hash,
+                                   std::equal_to<>>>
+        parts(threads);
+    auto res = write_ahead_log::replay(
+        cfg.path, threads, [&](unsigned p, const wal_record &r) {
+            if (r.op == wal_op::set) {
+                parts[p].insert_or_assign(std::string(r.key),
+                                          std::string(r.value));
+            } else if (auto it = parts[p].find(r.key); it != parts[p].end()) {
+                parts[p].erase(it);
+            }
+        });
+    for (auto &part : parts) {
+        for (auto &kv : part) {
+            vals.emplace_back(kv.first, std::move(kv.second));
+        }
+    }
+    m_replayed = res.records;
+    m_wal = std::make_unique<write_ahead_log>(std::move(cfg), res);
+}
+
 bool mock_db::begin_transaction() {
     if (state == transaction_state::started) {
         return false;
@@ -42,8 +137,36 @@ bool mock_db::commit_transaction() {
         return false;
     }
     state = transaction_state::started;
-    bool res = pl.run();
+    bool res;
+    if (m_wal == nullptr) {
+        res = pl.run();
+    } else if (!m_wal->ok()) {
+        res = false;
+    } else {
+        uint64_t ticket = 0;
+        {
+            std::unique_lock gate(m_commit_gate_);
+            // a failed run may have applied some ops, the log says which
+            res = pl.run();
+            std::unique_lock lock(m_mutex_);
+            if (!m_tx_log.empty()) {
+                ticket = m_wal->append(m_tx_log.payload());
+                m_tx_log.clear();
+                for (auto it = m_undo.rbegin();
+                     it != m_undo.rend() && it->ticket == PendingTicket;
+                     ++it) {
+                    it->ticket = ticket;
+                }
+            }
+        }
+        if (ticket != 0 && !m_wal->wait(ticket)) {
+            rollback_undurable();
+            res = false;
+        }
+    }
+    pl.clear();
     state = transaction_state::off;
+    m_stats.add(res ? tx_committed : tx_failed);
     return res;
 }
 bool mock_db::abort_transaction() {
@@ -56,19 +179,21 @@ bool mock_db::abort_transaction() {
         pl.cancel();
     }
     state = transaction_state::off;
+    m_stats.add(tx_aborted);
     return true;
 }
 
 std::string mock_db::get(const std::string &key) {
     if (state == transaction_state::ready) {
-        pl.add(&mock_db::_get, this, key);
+        pl.add<&mock_db::_get>(this, key);
         return "ok";
     } else {
         return _get(key);
     }
 }
 
-std::string mock_db::_get(const std::string &key) {
+std::string mock_db::_get(std::string_view key) {
+    m_stats.add(gets);
     std::shared_lock lock(m_mutex_);
     for (int i = 0; i < vals.size(); i++) {
         if (vals[i].first == key) {
@@ -80,42 +205,134 @@ std::string mock_db::_get(const std::string &key) {
 
 std::string mock_db::set(const std::string &key, const std::string &data) {
     if (state == transaction_state::ready) {
-        pl.add(&mock_db::_set, this, key, data);
+        pl.add<&mock_db::_set>(this, key, data);
         return "ok";
     } else {
-        return _set(key, data);
-    }
-}
-
-std::string mock_db::_set(const std::string &key, const std::string &data) {
-    std::unique_lock lock(m_mutex_);
-    for (int i = 0; i < vals.size(); i++) {
-        if (vals[i].first == key) {
-            vals[i].second = data;
-            return data;
-        }
+        return write(wal_op::set, key, data);
     }
-    const std::pair<std::string, std::string> p(key, data);
-    vals.emplace_back(p);
-    return data;
 }
 
 std::string mock_db::remove(const std::string &key) {
     if (state == transaction_state::ready) {
-        pl.add(&mock_db::_remove, this, key);
+        pl.add<&mock_db::_remove>(this, key);
         return "ok";
     } else {
-        return _remove(key);
+        return write(wal_op::remove, key, {});
     }
 }
 
-std::string mock_db::_remove(const std::string &key) {
+std::string mock_db::write(wal_op op, std::string_view key,
+                           std::string_view data) {
+    if (m_wal == nullptr) {
+        return apply(op, key, data, nullptr);
+    }
+    if (!m_wal->ok()) {
+        return "";
+    }
+    uint64_t ticket = 0;
+    std::string res;
+    {
+        std::shared_lock gate(m_commit_gate_);
+        res = apply(op, key, data, &ticket);
+    }
+    if (ticket != 0 && !m_wal->wait(ticket)) {
+        rollback_undurable();
+        return "";
+    }
+    return res;
+}
+
+std::string mock_db::apply(wal_op op, std::string_view key,
+                           std::string_view data, uint64_t *ticket) {
+    m_stats.add(op == wal_op::set ? sets : removes);
     std::unique_lock lock(m_mutex_);
-    for (auto it = vals.begin(); it != vals.end(); ++it) {
-        if (it->first == key) {
-            vals.erase(it);
-            return "ok";
+    auto it = std::find_if(vals.begin(), vals.end(),
+                           [&](const auto &kv) { return kv.first == key; });
+    if (op == wal_op::remove && it == vals.end()) {
+        return "";
+    }
+    std::optional<std::string> prev;
+    if (it != vals.end() && m_wal != nullptr) {
+        prev = it->second;
+    }
+    std::string res;
+    if (op == wal_op::set) {
+        if (it != vals.end()) {
+            it->second = data;
+        } else {
+            vals.emplace_back(key, data);
         }
+        res = data;
+    } else {
+        vals.erase(it);
+        res = "ok";
     }
-    return "";
-}
\ No newline at end of file
+
+    if (m_wal != nullptr) {
+        // frames up to durable() can't be rolled back any more
+        while (!m_undo.empty() && m_undo.front().ticket <= m_wal->durable()) {
+            m_undo.pop_front();
+        }
+        uint64_t undo_ticket = PendingTicket;
+        if (ticket != nullptr) {
+            m_op_log.clear();
+            m_op_log.add(op, key, data);
+            *ticket = undo_ticket = m_wal->append(m_op_log.payload());
+        } else {
+            m_tx_log.add(op, key, data);
+        }
+        m_undo.push_back({undo_ticket, std::string(key), std::move(prev)});
+    }
+    return res;
+}
+
+void mock_db::rollback_undurable() {
+    std::unique_lock lock(m_mutex_);
+    const uint64_t durable = m_wal->durable();
+    while (!m_undo.empty() && m_undo.back().ticket > durable) {
+        undo_record &u = m_undo.back();
+        auto it = std::find_if(vals.begin(), vals.end(), [&](const auto &kv) {
+            return kv.first == u.key;
+        });
+        if (!u.prev) {
+            if (it != vals.end()) {
+                vals.erase(it);
+            }
+        } else if (it != vals.end()) {
+            it->second = std::move(*u.prev);
+        } else {
+            vals.emplace_back(std::move(u.key), std::move(*u.prev));
+        }
+        m_undo.pop_back();
+    }
+}
+
+std::string mock_db::stats_json() {
+    size_t entries;
+    {
+        std::shared_lock lock(m_mutex_);
+        entries = vals.size();
+    }
+    const pipeline_stats &ps = pl.stats();
+
+    std::ostringstream os;
+    os << "{\"entries\": " << entries << ", \"gets\": " << m_stats.read(gets)
+       << ", \"sets\": " << m_stats.read(sets)
+       << ", \"removes\": " << m_stats.read(removes)
+       << ", \"tx_committed\": " << m_stats.read(tx_committed)
+       << ", \"tx_failed\": " << m_stats.read(tx_failed)
+       << ", \"tx_aborted\": " << m_stats.read(tx_aborted)
+       << ", \"pipeline\": {\"runs\": " << ps.runs
+       << ", \"failed\": " << ps.failed << ", \"retries\": " << ps.retries
+       << ", \"cancelled\": " << ps.cancelled << ", \"ops\": " << ps.ops
+       << "}";
+    if (m_wal != nullptr) {
+        const wal_stats ws = m_wal->stats();
+        os << ", \"wal\": {\"appends\": " << ws.appends
+           << ", \"syncs\": " << ws.syncs << ", \"bytes\": " << ws.bytes
+           << ", \"replayed\": " << m_replayed
+           << ", \"ok\": " << (m_wal->ok() ? "true" : "false") << "}";
+    }
+    os << "}";
+    return os.str();
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include "stdint.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// TinyLFU style frequency estimate: 4 rows of saturating 4 bit counts
+// (kept in bytes). Every `width * 10` additions all counts are halved,
+// so the estimate follows what is hot lately. Not thread safe.
+struct frequency_sketch {
+    static constexpr uint8_t MaxCount = 15;
+
+    void resize(size_t width) {
+        width = std::bit_ceil(std::max<size_t>(width, 64));
+        m_rows.assign(Rows * width, 0);
+        m_mask = width - 1;
+        m_adds = 0;
+    }
+
+    void add(size_t h) {
+        if (m_rows.empty()) {
+            return;
+        }
+        for (size_t r = 0; r < Rows; ++r) {
+            uint8_t &c = m_rows[slot(h, r)];
+            if (c < MaxCount) {
+                ++c;
+            }
+        }
+        if (++m_adds >= (m_mask + 1) * 10) {
+            age();
+        }
+    }
+
+    uint8_t estimate(size_t h) const {
+        if (m_rows.empty()) {
+            return 0;
+        }
+        uint8_t res = MaxCount;
+        for (size_t r = 0; r < Rows; ++r) {
+            res = std::min(res, m_rows[slot(h, r)]);
+        }
+        return res;
+    }
+
+  private:
+    static constexpr size_t Rows = 4;
+
+    size_t slot(size_t h, size_t row) const {
+        static constexpr uint64_t Seeds[Rows] = {
+            0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full,
+            0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+        const uint64_t x = (uint64_t(h) + Seeds[row]) * Seeds[row];
+        return row * (m_mask + 1) + ((x >> 32) & m_mask);
+    }
+
+    void age() {
+        for (uint8_t &c : m_rows) {
+            c >>= 1;
+        }
+        m_adds /= 2;
+    }
+
+    std::vector<uint8_t> m_rows;
+    size_t m_mask = 0;
+    size_t m_adds = 0;
+};
+
+// Small per thread front cache for the hottest keys of one shared cache.
+// Every thread owns a direct mapped table, lookups take no lock and touch
+// no shared state apart from one stripe version.
+//
+// Coherence: the owner bumps the version of a key's stripe whenever it
+// changes or drops the key, with its map lock held exclusively. A table
+// entry remembers the stripe version it was filled at, read under the
+// shared lock together with the value, and is only served while that is
+// unchanged.
+//
+// Admission: a miss in the table counts the key in a per thread sketch, a
+// key only takes a slot if it was seen more often than the current holder.
+struct near_cache {
+    static constexpr size_t Stripes = 1024;
+    // how often a key must be seen before it may take a free slot
+    static constexpr uint8_t AdmitMin = 2;
+
+    // `slots` per thread, rounded up to a power of two, 0 disables it
+    explicit near_cache(size_t slots)
+        : m_slots(slots == 0 ? 0 : std::bit_ceil(slots)), m_id(next_id()) {}
+    near_cache(const near_cache &) = delete;
+    near_cache &operator=(const near_cache &) = delete;
+
+    bool enabled() const { return m_slots != 0; }
+
+    // writer side, called with the owner's map lock held exclusively
+    void invalidate(size_t h) {
+        m_stripes[h & (Stripes - 1)].fetch_add(1, std::memory_order_release);
+    }
+
+    // what a fill has to remember, read under the owner's shared lock
+    uint64_t stamp_of(size_t h) const {
+        return m_stripes[h & (Stripes - 1)].load(std::memory_order_acquire);
+    }
+
+    // the value cached by this thread, nullptr when absent or stale;
+    // valid until this thread's next call into the near cache
+    const std::string *find(std::string_view key, size_t h, uint64_t now) {
+        table &t = local();
+        const entry &e = t.slots[h & (m_slots - 1)];
+        if (e.hash == h && e.key == key && fresh(e, now)) {
+            return &e.value;
+        }
+        t.sketch.add(h);
+        return nullptr;
+    }
+
+    // offers a value read from the owner, kept if the admission filter
+    // prefers it over whatever holds its slot
+    void offer(std::string_view key, std::string_view value,
+               uint64_t expires_at, size_t h, uint64_t stamp, uint64_t now) {
+        table &t = local();
+        entry &e = t.slots[h & (m_slots - 1)];
+        const uint8_t freq = t.sketch.estimate(h);
+        if (e.hash != h || e.key != key) {
+            const bool taken = fresh(e, now);
+            if (taken ? freq <= t.sketch.estimate(e.hash) : freq < AdmitMin) {
+                return;
+            }
+        }
+        e.key.assign(key.data(), key.size());
+        e.value.assign(value.data(), value.size());
+        e.expires_at = expires_at;
+        e.hash = h;
+        e.version = stamp;
+    }
+
+  private:
+    struct entry {
+        std::string key;
+        std::string value;
+        // 0 marks an unused slot
+        uint64_t expires_at = 0;
+        size_t hash = 0;
+        uint64_t version = 0;
+    };
+    // One per thread. It follows the near_cache the thread used last,
+    // switching between caches starts over with an empty table.
+    struct table {
+        uint64_t owner = 0;
+        std::vector<entry> slots;
+        frequency_sketch sketch;
+    };
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id = 0;
+        return ++id;
+    }
+
+    table &local() {
+        thread_local table t;
+        if (t.owner != m_id) {
+            t.owner = m_id;
+            t.slots.assign(m_slots, entry{});
+            t.sketch.resize(m_slots * 4);
+        }
+        return t;
+    }
+
+    bool fresh(const entry &e, uint64_t now) const {
+        return e.expires_at > now && e.version == stamp_of(e.hash);
+    }
+
+    const size_t m_slots;
+    // ids are never reused, a table can't outlive its cache unnoticed
+    const uint64_t m_id;
+    std::atomic<uint64_t> m_stripes[Stripes] = {};
+};
@@ -1,9 +1,15 @@
 #pragma once
+#include "stdint.h"
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <mutex>
 #include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 enum class transaction_state {
@@ -12,6 +18,136 @@ enum class transaction_state {
     started = 1 << 2,
 };
 
+// outcomes of Pipeline::run, cumulative
+struct pipeline_stats {
+    std::atomic<uint64_t> runs = 0;
+    std::atomic<uint64_t> failed = 0;
+    std::atomic<uint64_t> retries = 0;
+    std::atomic<uint64_t> cancelled = 0;
+    std::atomic<uint64_t> ops = 0;
+};
+
+// Fixed set of threads behind parallel_for, the calling thread helps out.
+// One job runs at a time, concurrent callers queue up.
+struct worker_pool {
+    explicit worker_pool(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            m_threads.emplace_back(&worker_pool::loop, this);
+        }
+    }
+    ~worker_pool() {
+        {
+            std::lock_guard lk(m_mutex_);
+            _stop = true;
+        }
+        m_cv.notify_all();
+        for (auto &t : m_threads) {
+            t.join();
+        }
+    }
+
+    static worker_pool &shared() {
+        static worker_pool pool(shared_threads() - 1);
+        return pool;
+    }
+    // threads of shared() counting the caller, only has an effect before
+    // its first use
+    static void set_shared_threads(size_t threads) {
+        shared_threads() = std::max<size_t>(threads, 1);
+    }
+
+    size_t size() const { return m_threads.size() + 1; }
+
+    // calls f(i) for every i in [0, n), returns once all calls are done
+    template <typename F> void parallel_for(size_t n, F &f) {
+        job j;
+        j.fn = [](void *ctx, size_t i) { (*static_cast<F *>(ctx))(i); };
+        j.ctx = &f;
+        j.size = n;
+        j.pending = n;
+
+        std::lock_guard job_lock(m_job_mutex_);
+        {
+            std::lock_guard lk(m_mutex_);
+            m_job = &j;
+            ++m_generation;
+        }
+        m_cv.notify_all();
+        work(j);
+
+        std::unique_lock lk(m_mutex_);
+        m_done_cv.wait(lk, [&] { return j.pending == 0 && j.active == 0; });
+        m_job = nullptr;
+    }
+
+  private:
+    static size_t &shared_threads() {
+        static size_t n = std::max(1u, std::thread::hardware_concurrency());
+        return n;
+    }
+
+    struct job {
+        void (*fn)(void *, size_t);
+        void *ctx;
+        size_t size;
+        std::atomic<size_t> next = 0;
+        std::atomic<size_t> pending;
+        // workers inside work(), guarded by m_mutex_
+        size_t active = 0;
+    };
+
+    void work(job &j) {
+        for (size_t i; (i = j.next.fetch_add(1)) < j.size;) {
+            j.fn(j.ctx, i);
+            if (j.pending.fetch_sub(1) == 1) {
+                std::lock_guard lk(m_mutex_);
+                m_done_cv.notify_all();
+            }
+        }
+    }
+
+    void loop() {
+        uint64_t seen = 0;
+        std::unique_lock lk(m_mutex_);
+        while (true) {
+            m_cv.wait(lk, [&] { return _stop || m_generation != seen; });
+            if (_stop) {
+                return;
+            }
+            seen = m_generation;
+            if (m_job == nullptr) {
+                continue;
+            }
+            job &j = *m_job;
+            ++j.active;
+            lk.unlock();
+            work(j);
+            lk.lock();
+            --j.active;
+            m_done_cv.notify_all();
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_job_mutex_;
+    std::mutex m_mutex_;
+    std::condition_variable m_cv;
+    std::condition_variable m_done_cv;
+    job *m_job = nullptr;
+    uint64_t m_generation = 0;
+    bool _stop = false;
+};
+
+// Operation log of a transaction. Ops are tagged structs (handler, target,
+// key, value) and their strings live in one arena, so queueing does no per
+// op allocation once the buffers have grown.
+//
+// run() goes through a group commit: pipelines that start running while
+// another batch executes are applied together in the next batch. Big
+// batches are split by key and independent keys run in parallel on
+// worker_pool::shared(), ops on the same key keep their queue order.
+// Batches with a pipeline that stops on failure run serially, only then
+// no op queued after the failing one gets applied.
 struct Pipeline {
     enum class fail_policy {
         ignore = 0,
@@ -20,67 +156,248 @@ struct Pipeline {
         restore = 1 << 2
     };
     using fp = fail_policy;
+    // "" means failure, same as the i_db calls
+    using op_fn = std::string (*)(void *target, std::string_view key,
+                                  std::string_view data);
+
+    // batches smaller than this run on the calling thread
+    static constexpr size_t ParallelMinOps = 64;
 
-    template <typename Func, typename... Args>
-    void add(Func &&func, Args &&...args) {
+    // queues obj->*MemFn(key) or obj->*MemFn(key, data)
+    template <auto MemFn, typename Obj>
+    void add(Obj *obj, std::string_view key, std::string_view data = {}) {
+        add_op(&invoke_member<MemFn, Obj>, obj, key, data);
+    }
+
+    void add_op(op_fn fn, void *target, std::string_view key,
+                std::string_view data) {
         std::unique_lock lock(_mtx);
-        pipeline.emplace_back([this, func = std::forward<Func>(func),
-                               ... args = std::forward<Args>(args)]() mutable {
-            if constexpr (std::is_same_v<std::invoke_result_t<Func, Args...>,
-                                         std::string>) {
-                std::string res = std::invoke(func, args...);
-
-                if (res == "" && _policy != fp::ignore)
-                    failed = true;
-            } else {
-                std::invoke(func, args...);
-            }
-        });
+        op o;
+        o.fn = fn;
+        o.target = target;
+        o.key_off = m_arena.size();
+        o.key_len = key.size();
+        m_arena.append(key);
+        o.data_off = m_arena.size();
+        o.data_len = data.size();
+        m_arena.append(data);
+        m_ops.push_back(o);
     }
+
     void set_fail_policy(fail_policy new_policy) { _policy = new_policy; }
+    const pipeline_stats &stats() const { return _stats; }
+    size_t size() const { return m_ops.size(); }
 
     bool run() {
-        int attempt = 0;
-        force_quit = false;
-
         std::shared_lock lock(_mtx);
-        for (const auto &func : pipeline) {
-        iteration_begin:
-            if (force_quit) {
-                force_quit = false;
+        {
+            std::lock_guard lk(cancel_mtx);
+            force_quit = false;
+            aborted = false;
+            running = true;
+        }
+        ++_stats.runs;
+
+        committer &c = commit_queue();
+        std::unique_lock lk(c.mtx);
+        c.queue.push_back(this);
+        done = false;
+        c.cv.wait(lk, [&] { return done || !c.leader; });
+        if (!done) {
+            // nobody is executing, take everything queued so far
+            c.leader = true;
+            c.batch.swap(c.queue);
+            lk.unlock();
+            execute_batch(c);
+            lk.lock();
+            for (Pipeline *p : c.batch) {
+                p->done = true;
+            }
+            c.batch.clear();
+            c.leader = false;
+            c.cv.notify_all();
+        }
+        lk.unlock();
+
+        const bool quit = force_quit;
+        if (quit) {
+            ++_stats.cancelled;
+        } else if (aborted) {
+            ++_stats.failed;
+        }
+        lock.unlock();
+        {
+            std::lock_guard cl(cancel_mtx);
+            if (quit) {
                 clear();
-                cancel_cv.notify_all();
+            }
+            running = false;
+        }
+        cancel_cv.notify_all();
+        return !quit && !aborted;
+    }
+
+    void clear() {
+        m_ops.clear();
+        m_arena.clear();
+    }
+
+    // stops a running pipeline before its next op and waits for run()
+    // to return, the remaining ops are dropped
+    void cancel() {
+        force_quit = true;
+        std::unique_lock lk(cancel_mtx);
+        cancel_cv.wait(lk, [&] { return !running; });
+    }
+
+  private:
+    struct op {
+        op_fn fn;
+        void *target;
+        uint32_t key_off;
+        uint32_t key_len;
+        uint32_t data_off;
+        uint32_t data_len;
+    };
+
+    // an op of some pipeline in the current batch, chained per key
+    struct op_ref {
+        Pipeline *pl;
+        uint32_t idx;
+        uint32_t next;
+    };
+    struct key_group {
+        std::string_view key;
+        uint32_t head;
+        uint32_t tail;
+    };
+    static constexpr uint32_t None = UINT32_MAX;
+
+    struct committer {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<Pipeline *> queue;
+        std::vector<Pipeline *> batch;
+        bool leader = false;
+        // leader only scratch, kept to reuse the buffers
+        std::vector<op_ref> refs;
+        std::vector<key_group> groups;
+        std::vector<uint32_t> table;
+    };
+    static committer &commit_queue() {
+        static committer c;
+        return c;
+    }
+
+    template <auto MemFn, typename Obj>
+    static std::string invoke_member(void *target, std::string_view key,
+                                     std::string_view data) {
+        Obj *obj = static_cast<Obj *>(target);
+        if constexpr (std::is_invocable_v<decltype(MemFn), Obj *,
+                                          std::string_view,
+                                          std::string_view>) {
+            return std::invoke(MemFn, obj, key, data);
+        } else {
+            return std::invoke(MemFn, obj, key);
+        }
+    }
+
+    std::string_view key_of(const op &o) const {
+        return std::string_view(m_arena).substr(o.key_off, o.key_len);
+    }
+
+    // false once this pipeline must not run further ops
+    bool exec(uint32_t idx) {
+        const op &o = m_ops[idx];
+        const std::string_view data =
+            std::string_view(m_arena).substr(o.data_off, o.data_len);
+        for (int attempt = 0;; ++attempt) {
+            if (force_quit || aborted) {
                 return false;
             }
-            func();
-            if (failed) {
-                failed = false;
+            std::string res = o.fn(o.target, key_of(o), data);
+            ++_stats.ops;
+            if (res == "" && _policy != fp::ignore) {
                 if (_policy == fp::retry && attempt < 2) {
-                    // evil ;)
-                    goto iteration_begin;
+                    ++_stats.retries;
+                    continue;
                 } else if (_policy == fp::abort) {
+                    aborted = true;
                     return false;
                 }
             }
-
             ++processed;
+            return true;
         }
-        return true;
     }
-    void clear() { pipeline.clear(); }
-    void cancel() {
-        force_quit = true;
-        std::unique_lock lk(cancel_mtx);
-        cancel_cv.wait(lk, [&] { return pipeline.size() == 0; });
+
+    static void execute_batch(committer &c) {
+        size_t total = 0;
+        bool serial = worker_pool::shared().size() == 1;
+        for (Pipeline *p : c.batch) {
+            total += p->m_ops.size();
+            serial = serial || p->_policy != fp::ignore;
+        }
+        if (serial || total < ParallelMinOps) {
+            for (Pipeline *p : c.batch) {
+                for (uint32_t i = 0; i < p->m_ops.size() && p->exec(i); ++i) {
+                }
+            }
+            return;
+        }
+
+        // chain the ops of every key, in arrival order
+        c.refs.clear();
+        c.groups.clear();
+        size_t slots = 16;
+        while (slots < total * 2) {
+            slots *= 2;
+        }
+        c.table.assign(slots, None);
+        for (Pipeline *p : c.batch) {
+            for (uint32_t i = 0; i < p->m_ops.size(); ++i) {
+                const std::string_view key = p->key_of(p->m_ops[i]);
+                const uint32_t ref = c.refs.size();
+                c.refs.push_back({p, i, None});
+
+                size_t s = std::hash<std::string_view>{}(key) & (slots - 1);
+                while (c.table[s] != None && c.groups[c.table[s]].key != key) {
+                    s = (s + 1) & (slots - 1);
+                }
+                if (c.table[s] == None) {
+                    c.table[s] = c.groups.size();
+                    c.groups.push_back({key, ref, ref});
+                } else {
+                    key_group &g = c.groups[c.table[s]];
+                    c.refs[g.tail].next = ref;
+                    g.tail = ref;
+                }
+            }
+        }
+
+        auto run_group = [&](size_t g) {
+            for (uint32_t r = c.groups[g].head; r != None; r = c.refs[r].next) {
+                c.refs[r].pl->exec(c.refs[r].idx);
+            }
+        };
+        if (c.groups.size() == 1) {
+            run_group(0);
+        } else {
+            worker_pool::shared().parallel_for(c.groups.size(), run_group);
+        }
     }
 
-  private:
-    fail_policy _policy;
-    std::vector<std::function<void()>> pipeline;
+    fail_policy _policy = fp::ignore;
+    std::vector<op> m_ops;
+    std::string m_arena;
     mutable std::shared_mutex _mtx;
     mutable std::mutex cancel_mtx;
     std::condition_variable cancel_cv;
-    std::atomic<bool> failed;
-    std::atomic<bool> force_quit;
-    int processed;
-};
\ No newline at end of file
+    std::atomic<bool> aborted = false;
+    std::atomic<bool> force_quit = false;
+    bool running = false;
+    // guarded by the committer's mutex
+    bool done = false;
+    std::atomic<int> processed = 0;
+    pipeline_stats _stats;
+};
@@ -0,0 +1,333 @@
+#pragma once
+#include "cache.h"
+
+#if __has_include(<asio.hpp>)
+#include <asio.hpp>
+#else
+// boost 1.74 asio uses std::exchange without including it
+#include <utility>
+
+#include <boost/asio.hpp>
+namespace asio = boost::asio;
+#endif
+
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+// Parses one request out of `in`, either a RESP array of bulk strings
+// or an inline command ("GET key\r\n"). Views in `args` point into `in`.
+// Returns consumed bytes, 0 when the request is incomplete, -1 on garbage.
+inline long parse_request(std::string_view in,
+                          std::vector<std::string_view> &args) {
+    args.clear();
+    auto read_line = [&](size_t from, std::string_view &line) -> size_t {
+        size_t eol = in.find("\r\n", from);
+        if (eol == std::string_view::npos) {
+            return 0;
+        }
+        line = in.substr(from, eol - from);
+        return eol + 2;
+    };
+    auto read_int = [](std::string_view sv, long &out) {
+        auto res = std::from_chars(sv.data(), sv.data() + sv.size(), out);
+        return res.ec == std::errc() && res.ptr == sv.data() + sv.size();
+    };
+
+    if (in.empty()) {
+        return 0;
+    }
+    std::string_view line;
+    size_t pos = read_line(0, line);
+    if (pos == 0) {
+        return 0;
+    }
+
+    if (in[0] != '*') {
+        while (!line.empty()) {
+            size_t sp = line.find(' ');
+            if (sp != 0) {
+                args.push_back(line.substr(0, sp));
+            }
+            if (sp == std::string_view::npos) {
+                break;
+            }
+            line.remove_prefix(sp + 1);
+        }
+        return pos;
+    }
+
+    long count = 0;
+    if (!read_int(line.substr(1), count) || count < 0) {
+        return -1;
+    }
+    for (long i = 0; i < count; ++i) {
+        size_t next = read_line(pos, line);
+        if (next == 0) {
+            return 0;
+        }
+        long len = 0;
+        if (line.empty() || line[0] != '$' || !read_int(line.substr(1), len) ||
+            len < 0) {
+            return -1;
+        }
+        if (in.size() < next + len + 2) {
+            return 0;
+        }
+        args.push_back(in.substr(next, len));
+        pos = next + len + 2;
+    }
+    return pos;
+}
+
+inline void reply_bulk(std::string &out, std::string_view data) {
+    out += '$';
+    out += std::to_string(data.size());
+    out += "\r\n";
+    out += data;
+    out += "\r\n";
+}
+
+// Serves a cache over TCP and unix sockets. Requests are RESP (the redis
+// protocol) or inline: PING, GET, SET, DEL, MULTI, EXEC, DISCARD, FLUSH,
+// STATS.
+// Every read is parsed and executed as a batch, the replies leave in one
+// write. MULTI queues commands per connection, EXEC runs them while all
+// other connections are held off.
+struct cache_server {
+    cache_server(cache &ch, int threads = std::thread::hardware_concurrency())
+        : m_cache(ch), m_threads(threads > 0 ? threads : 1),
+          m_signals(m_io, SIGINT, SIGTERM) {
+        m_signals.async_wait([this](auto, int) { stop(); });
+    }
+
+    void listen_tcp(const std::string &address, uint16_t port) {
+        asio::ip::tcp::endpoint ep(asio::ip::make_address(address), port);
+        auto acc = std::make_shared<asio::ip::tcp::acceptor>(m_io, ep);
+        accept(acc);
+    }
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS) || defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    void listen_unix(const std::string &path) {
+        ::unlink(path.c_str());
+        asio::local::stream_protocol::endpoint ep(path);
+        auto acc =
+            std::make_shared<asio::local::stream_protocol::acceptor>(m_io, ep);
+        accept(acc);
+    }
+#endif
+
+    // blocks until stop() or SIGINT/SIGTERM
+    void run() {
+        std::vector<std::thread> pool;
+        for (int i = 1; i < m_threads; ++i) {
+            pool.emplace_back([this] { m_io.run(); });
+        }
+        m_io.run();
+        for (auto &t : pool) {
+            t.join();
+        }
+    }
+
+    void stop() { m_io.stop(); }
+
+  private:
+    struct conn_state {
+        bool in_multi = false;
+        std::vector<std::vector<std::string>> queued;
+    };
+
+    template <typename Socket>
+    struct session : std::enable_shared_from_this<session<Socket>> {
+        static constexpr size_t ReadSize = 16 * 1024;
+        static constexpr size_t MaxRequest = 64 * 1024 * 1024;
+
+        session(Socket sock, cache_server &srv)
+            : m_sock(std::move(sock)), m_srv(srv) {}
+
+        void start() { do_read(); }
+
+      private:
+        void do_read() {
+            if (m_in.size() - m_in_len < ReadSize) {
+                m_in.resize(m_in_len + ReadSize);
+            }
+            m_sock.async_read_some(
+                asio::buffer(m_in.data() + m_in_len, m_in.size() - m_in_len),
+                [self = this->shared_from_this()](auto ec, size_t n) {
+                    if (ec) {
+                        return;
+                    }
+                    self->m_in_len += n;
+                    self->on_read();
+                });
+        }
+
+        void on_read() {
+            std::string_view in(m_in.data(), m_in_len);
+            size_t consumed = m_srv.execute_batch(in, m_state, m_args, m_out);
+            if (consumed == size_t(-1) || m_in_len - consumed > MaxRequest) {
+                m_out += "-ERR protocol error\r\n";
+                m_closing = true;
+                consumed = m_in_len;
+            }
+            std::memmove(m_in.data(), m_in.data() + consumed,
+                         m_in_len - consumed);
+            m_in_len -= consumed;
+
+            if (m_out.empty()) {
+                do_read();
+                return;
+            }
+            asio::async_write(
+                m_sock, asio::buffer(m_out),
+                [self = this->shared_from_this()](auto ec, size_t) {
+                    self->m_out.clear();
+                    if (!ec && !self->m_closing) {
+                        self->do_read();
+                    }
+                });
+        }
+
+        Socket m_sock;
+        cache_server &m_srv;
+        conn_state m_state;
+        std::vector<char> m_in;
+        size_t m_in_len = 0;
+        std::vector<std::string_view> m_args;
+        std::string m_out;
+        bool m_closing = false;
+    };
+
+    template <typename Acceptor> void accept(std::shared_ptr<Acceptor> acc) {
+        acc->async_accept([this, acc](auto ec, auto sock) {
+            if (!ec) {
+                using sock_t = decltype(sock);
+                std::make_shared<session<sock_t>>(std::move(sock), *this)
+                    ->start();
+            }
+            if (acc->is_open()) {
+                accept(acc);
+            }
+        });
+    }
+
+    // returns consumed bytes, size_t(-1) on a malformed request
+    size_t execute_batch(std::string_view in, conn_state &st,
+                         std::vector<std::string_view> &args,
+                         std::string &out) {
+        size_t consumed = 0;
+        std::shared_lock shared(m_exec_mutex_, std::defer_lock);
+        while (consumed < in.size()) {
+            long n = parse_request(in.substr(consumed), args);
+            if (n < 0) {
+                return size_t(-1);
+            }
+            if (n == 0) {
+                break;
+            }
+            consumed += n;
+            if (args.empty()) {
+                continue;
+            }
+
+            std::string cmd(args[0]);
+            for (char &c : cmd) {
+                c = std::toupper(static_cast<unsigned char>(c));
+            }
+            if (cmd == "MULTI") {
+                out += st.in_multi ? "-ERR MULTI calls can not be nested\r\n"
+                                   : "+OK\r\n";
+                st.in_multi = true;
+            } else if (cmd == "DISCARD") {
+                out += st.in_multi ? "+OK\r\n"
+                                   : "-ERR DISCARD without MULTI\r\n";
+                st.in_multi = false;
+                st.queued.clear();
+            } else if (cmd == "EXEC") {
+                if (!st.in_multi) {
+                    out += "-ERR EXEC without MULTI\r\n";
+                    continue;
+                }
+                if (shared.owns_lock()) {
+                    shared.unlock();
+                }
+                std::unique_lock exclusive(m_exec_mutex_);
+                out += '*';
+                out += std::to_string(st.queued.size());
+                out += "\r\n";
+                std::vector<std::string_view> queued_args;
+                for (auto &q : st.queued) {
+                    queued_args.assign(q.begin(), q.end());
+                    execute(queued_args, out);
+                }
+                st.in_multi = false;
+                st.queued.clear();
+            } else if (st.in_multi) {
+                st.queued.emplace_back(args.begin(), args.end());
+                out += "+QUEUED\r\n";
+            } else {
+                // one shared lock for the whole batch
+                if (!shared.owns_lock()) {
+                    shared.lock();
+                }
+                execute(args, out);
+            }
+        }
+        return consumed;
+    }
+
+    void execute(const std::vector<std::string_view> &args, std::string &out) {
+        std::string cmd(args[0]);
+        for (char &c : cmd) {
+            c = std::toupper(static_cast<unsigned char>(c));
+        }
+
+        if (cmd == "PING") {
+            out += "+PONG\r\n";
+        } else if (cmd == "GET" && args.size() == 2) {
+            cache_ref ref = m_cache.get_ref(args[1]);
+            if (ref) {
+                reply_bulk(out, ref.value());
+            } else {
+                out += "$-1\r\n";
+            }
+        } else if (cmd == "SET" && args.size() == 3) {
+            std::string res =
+                m_cache.set(std::string(args[1]), std::string(args[2]));
+            out += res == "" ? "-ERR set failed\r\n" : "+OK\r\n";
+        } else if (cmd == "DEL" && args.size() >= 2) {
+            size_t removed = 0;
+            for (size_t i = 1; i < args.size(); ++i) {
+                removed += m_cache.remove(std::string(args[i])) != "";
+            }
+            out += ':';
+            out += std::to_string(removed);
+            out += "\r\n";
+        } else if (cmd == "FLUSH") {
+            m_cache.flush();
+            out += "+OK\r\n";
+        } else if (cmd == "STATS") {
+            reply_bulk(out, m_cache.stats_json());
+        } else {
+            out += "-ERR unknown command or wrong number of arguments\r\n";
+        }
+    }
+
+    cache &m_cache;
+    int m_threads;
+    asio::io_context m_io;
+    asio::signal_set m_signals;
+    // EXEC takes it exclusively, plain batches share it
+    std::shared_mutex m_exec_mutex_;
+};
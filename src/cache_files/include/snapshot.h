@@ -0,0 +1,298 @@
+#pragma once
+#include "flat_map.h"
+
+#include "stdint.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Cache snapshot file, native byte order:
+//   header  "SNCSNAP1", u64 index offset, u64 block count
+//   blocks  records of u64 expires_at, u32 key len, u32 value len, key, value
+//   index   u64 offset + u64 size for every block
+// Blocks are independent, so a reader can decode them in parallel.
+struct snapshot_header {
+    char magic[8];
+    uint64_t index_offset;
+    uint64_t block_count;
+};
+struct snapshot_block_ref {
+    uint64_t offset;
+    uint64_t size;
+};
+inline constexpr char SnapshotMagic[8] = {'S', 'N', 'C', 'S',
+                                          'N', 'A', 'P', '1'};
+
+// Writes to "<path>.tmp", syncs it and renames on commit(), an interrupted
+// snapshot never replaces a good one. add() only buffers, drain() does the I/O,
+// which lets the caller fill under a lock and write outside of it.
+struct snapshot_writer {
+    static constexpr size_t BlockSize = 1 << 20;
+
+    explicit snapshot_writer(std::string path)
+        : m_path(std::move(path)), m_tmp(m_path + ".tmp"),
+          m_out(m_tmp, std::ios::binary | std::ios::trunc) {
+        snapshot_header h = {};
+        m_out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        m_pos = sizeof(h);
+    }
+
+    bool ok() const { return m_out.good(); }
+
+    void add(std::string_view key, std::string_view value,
+             uint64_t expires_at) {
+        if (m_block_entries == 0) {
+            m_block_start = m_pos + m_buf.size();
+        }
+        const uint32_t key_len = key.size();
+        const uint32_t val_len = value.size();
+        m_buf.append(reinterpret_cast<const char *>(&expires_at),
+                     sizeof(expires_at));
+        m_buf.append(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+        m_buf.append(reinterpret_cast<const char *>(&val_len), sizeof(val_len));
+        m_buf.append(key);
+        m_buf.append(value);
+        ++m_block_entries;
+        ++m_entries;
+        if (m_pos + m_buf.size() - m_block_start >= BlockSize) {
+            close_block();
+        }
+    }
+
+    void drain() {
+        m_out.write(m_buf.data(), m_buf.size());
+        m_pos += m_buf.size();
+        m_buf.clear();
+    }
+
+    bool commit() {
+        close_block();
+        drain();
+        snapshot_header h;
+        std::memcpy(h.magic, SnapshotMagic, sizeof(h.magic));
+        h.index_offset = m_pos;
+        h.block_count = m_index.size();
+        m_out.write(reinterpret_cast<const char *>(m_index.data()),
+                    m_index.size() * sizeof(snapshot_block_ref));
+        m_out.seekp(0);
+        m_out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        m_out.close();
+        // the data must be on disk before the rename can be
+        if (!m_out || !sync_file(m_tmp)) {
+            std::remove(m_tmp.c_str());
+            return false;
+        }
+        if (std::rename(m_tmp.c_str(), m_path.c_str()) != 0) {
+            return false;
+        }
+        return sync_dir(m_path);
+    }
+
+    size_t entries() const { return m_entries; }
+
+  private:
+    static bool sync_file(const std::string &path) {
+#if defined(_WIN32)
+        const int fd = ::_open(path.c_str(), _O_RDWR | _O_BINARY);
+        if (fd < 0) {
+            return false;
+        }
+        const bool ok = ::_commit(fd) == 0;
+        ::_close(fd);
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        const bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+#endif
+        return ok;
+    }
+
+    // makes the rename itself durable, Windows has no directory handles
+    // to sync
+    static bool sync_dir(const std::string &path) {
+#if defined(_WIN32)
+        return true;
+#else
+        const size_t slash = path.rfind('/');
+        const std::string dir = slash == std::string::npos ? "."
+                                : slash == 0             ? "/"
+                                                         : path.substr(0, slash);
+        const int fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        const bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+#endif
+    }
+
+    void close_block() {
+        if (m_block_entries == 0) {
+            return;
+        }
+        const uint64_t end = m_pos + m_buf.size();
+        m_index.push_back({m_block_start, end - m_block_start});
+        m_block_entries = 0;
+    }
+
+    std::string m_path;
+    std::string m_tmp;
+    std::ofstream m_out;
+    std::string m_buf;
+    std::vector<snapshot_block_ref> m_index;
+    uint64_t m_pos = 0;
+    uint64_t m_block_start = 0;
+    size_t m_block_entries = 0;
+    size_t m_entries = 0;
+};
+
+struct snapshot_record {
+    std::string_view key;
+    std::string_view value;
+    uint64_t expires_at;
+    size_t hash;
+};
+
+// Maps a snapshot file (reads it whole where mmap is unavailable).
+// Records point into the mapping and stay valid as long as the reader.
+struct snapshot_reader {
+    explicit snapshot_reader(const std::string &path) {
+#if !defined(_WIN32)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p =
+                ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                m_data = static_cast<const char *>(p);
+                m_size = st.st_size;
+                ::madvise(p, m_size, MADV_WILLNEED);
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary);
+        m_buf.assign(std::istreambuf_iterator<char>(in), {});
+        m_data = m_buf.data();
+        m_size = m_buf.size();
+#endif
+        validate();
+    }
+
+    ~snapshot_reader() {
+#if !defined(_WIN32)
+        if (m_data != nullptr) {
+            ::munmap(const_cast<char *>(m_data), m_size);
+        }
+#endif
+    }
+    snapshot_reader(const snapshot_reader &) = delete;
+    snapshot_reader &operator=(const snapshot_reader &) = delete;
+
+    bool ok() const { return m_valid; }
+
+    // Decodes all blocks on up to `threads` threads, one result vector per
+    // thread. Entries that expire at or before `now` are skipped, keys come
+    // pre-hashed for flat_map.
+    std::vector<std::vector<snapshot_record>> load(uint64_t now,
+                                                   unsigned threads) const {
+        if (!m_valid || m_blocks.empty()) {
+            return {};
+        }
+        threads = std::clamp<unsigned>(threads, 1, m_blocks.size());
+        std::vector<std::vector<snapshot_record>> parts(threads);
+        auto decode = [&](unsigned t) {
+            for (size_t b = t; b < m_blocks.size(); b += threads) {
+                decode_block(m_blocks[b], now, parts[t]);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned t = 1; t < threads; ++t) {
+            pool.emplace_back(decode, t);
+        }
+        decode(0);
+        for (auto &th : pool) {
+            th.join();
+        }
+        return parts;
+    }
+
+  private:
+    void validate() {
+        snapshot_header h;
+        if (m_data == nullptr || m_size < sizeof(h)) {
+            return;
+        }
+        std::memcpy(&h, m_data, sizeof(h));
+        if (std::memcmp(h.magic, SnapshotMagic, sizeof(h.magic)) != 0 ||
+            h.index_offset > m_size ||
+            h.block_count > (m_size - h.index_offset) /
+                                sizeof(snapshot_block_ref)) {
+            return;
+        }
+        m_blocks.resize(h.block_count);
+        std::memcpy(m_blocks.data(), m_data + h.index_offset,
+                    h.block_count * sizeof(snapshot_block_ref));
+        for (const auto &b : m_blocks) {
+            if (b.offset > h.index_offset ||
+                b.size > h.index_offset - b.offset) {
+                return;
+            }
+        }
+        m_valid = true;
+    }
+
+    void decode_block(const snapshot_block_ref &b, uint64_t now,
+                      std::vector<snapshot_record> &out) const {
+        const char *p = m_data + b.offset;
+        const char *end = p + b.size;
+        constexpr size_t Fixed = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+        while (size_t(end - p) >= Fixed) {
+            uint64_t expires_at;
+            uint32_t key_len, val_len;
+            std::memcpy(&expires_at, p, sizeof(expires_at));
+            std::memcpy(&key_len, p + 8, sizeof(key_len));
+            std::memcpy(&val_len, p + 12, sizeof(val_len));
+            p += Fixed;
+            if (size_t(end - p) < size_t(key_len) + val_len) {
+                return; // truncated block, keep what decoded so far
+            }
+            if (expires_at > now) {
+                std::string_view key(p, key_len);
+                out.push_back({key, std::string_view(p + key_len, val_len),
+                               expires_at, flat_map::hash(key)});
+            }
+            p += key_len + val_len;
+        }
+    }
+
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_valid = false;
+    std::vector<snapshot_block_ref> m_blocks;
+#if defined(_WIN32)
+    std::string m_buf;
+#endif
+};
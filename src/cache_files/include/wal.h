@@ -0,0 +1,409 @@
+#pragma once
+#include "stdint.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Write-ahead log file, native byte order, a sequence of frames:
+//   u32 payload length, u32 crc32c of the payload, payload
+// A payload holds one or more records, all applied or none on replay:
+//   u8 op, u32 key len, u32 value len, key, value
+// Replay stops at the first short or corrupt frame, a torn tail left by a
+// crash is cut off before new frames are appended.
+enum class wal_op : uint8_t {
+    set = 1,
+    remove = 2,
+};
+
+struct wal_config {
+    std::string path;
+    // How long a group commit leader waits for more committers before it
+    // writes, 0 writes right away. Committers arriving while a write is
+    // in flight always join the next one.
+    std::chrono::microseconds flush_interval{0};
+    // fdatasync every group, otherwise the OS decides when data hits disk
+    bool sync = true;
+};
+
+inline uint32_t crc32c(std::string_view data) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t c = ~0u;
+    for (unsigned char b : data) {
+        c = table[(c ^ b) & 0xFF] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+// payload of one frame under construction
+struct wal_batch {
+    void add(wal_op op, std::string_view key, std::string_view value) {
+        const uint8_t code = uint8_t(op);
+        const uint32_t key_len = key.size();
+        const uint32_t val_len = value.size();
+        m_buf.push_back(char(code));
+        m_buf.append(reinterpret_cast<const char *>(&key_len), 4);
+        m_buf.append(reinterpret_cast<const char *>(&val_len), 4);
+        m_buf.append(key);
+        m_buf.append(value);
+    }
+    std::string_view payload() const { return m_buf; }
+    bool empty() const { return m_buf.empty(); }
+    void clear() { m_buf.clear(); }
+
+  private:
+    std::string m_buf;
+};
+
+struct wal_record {
+    wal_op op;
+    std::string_view key;
+    std::string_view value;
+    size_t hash;
+};
+
+struct wal_stats {
+    uint64_t appends = 0;
+    // group commits, each one write (and fdatasync)
+    uint64_t syncs = 0;
+    uint64_t bytes = 0;
+};
+
+// Appends frames with group commit: append() only queues a frame and
+// hands out a ticket, wait(ticket) returns once the frame is durable.
+// The first waiter to find no write in flight becomes the leader and
+// writes everything queued so far with one write and one fdatasync.
+struct write_ahead_log {
+    // Result of replay: frames and records applied and the size of the
+    // intact prefix of the file. `readable` is false if the log exists but
+    // couldn't be read.
+    struct replay_result {
+        uint64_t frames = 0;
+        uint64_t records = 0;
+        uint64_t valid_size = 0;
+        bool readable = true;
+    };
+
+    // Opens the log replay() went through, anything behind its intact
+    // prefix is truncated. A log it couldn't read is left alone and the
+    // new log starts out failed.
+    write_ahead_log(wal_config cfg, const replay_result &replayed)
+        : m_cfg(cfg) {
+        if (!replayed.readable) {
+            _failed = true;
+            return;
+        }
+        const uint64_t valid_size = replayed.valid_size;
+#if defined(_WIN32)
+        m_fd = ::_open(m_cfg.path.c_str(),
+                       _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY,
+                       _S_IREAD | _S_IWRITE);
+        if (m_fd >= 0 && ::_chsize_s(m_fd, valid_size) != 0) {
+            close_fd();
+        }
+#else
+        m_fd = ::open(m_cfg.path.c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                      0644);
+        if (m_fd >= 0 && ::ftruncate(m_fd, valid_size) != 0) {
+            close_fd();
+        }
+#endif
+        _failed = m_fd < 0;
+    }
+    ~write_ahead_log() {
+        // nothing can wait for the frames still queued, write them anyway
+        if (m_fd >= 0 && !m_pending.empty()) {
+            write_out(m_pending);
+        }
+        close_fd();
+    }
+    write_ahead_log(const write_ahead_log &) = delete;
+    write_ahead_log &operator=(const write_ahead_log &) = delete;
+
+    // false once opening or writing the log failed, it stays failed
+    bool ok() const { return !_failed.load(std::memory_order_acquire); }
+    // every ticket up to this one is on disk
+    uint64_t durable() const {
+        return m_synced.load(std::memory_order_acquire);
+    }
+
+    // queues one frame, callers that need a global order call this under
+    // the same lock that orders their changes
+    uint64_t append(std::string_view payload) {
+        const uint32_t len = payload.size();
+        const uint32_t crc = crc32c(payload);
+        std::lock_guard lk(m_mutex_);
+        m_pending.append(reinterpret_cast<const char *>(&len), 4);
+        m_pending.append(reinterpret_cast<const char *>(&crc), 4);
+        m_pending.append(payload);
+        ++m_stats.appends;
+        return ++m_appended;
+    }
+
+    // false if the frame (or any frame before it) couldn't be written,
+    // durable() then stays below the ticket
+    bool wait(uint64_t ticket) {
+        std::unique_lock lk(m_mutex_);
+        while (m_durable < ticket) {
+            if (_writing) {
+                m_cv.wait(lk);
+                continue;
+            }
+            _writing = true;
+            if (m_cfg.flush_interval.count() > 0) {
+                lk.unlock();
+                std::this_thread::sleep_for(m_cfg.flush_interval);
+                lk.lock();
+            }
+            m_writing_buf.swap(m_pending);
+            const uint64_t upto = m_appended;
+            lk.unlock();
+
+            const bool ok = !_failed && write_out(m_writing_buf);
+            const uint64_t bytes = m_writing_buf.size();
+            m_writing_buf.clear();
+
+            lk.lock();
+            if (!ok) {
+                _failed = true;
+            } else {
+                m_synced.store(upto, std::memory_order_release);
+            }
+            ++m_stats.syncs;
+            m_stats.bytes += bytes;
+            m_durable = upto;
+            _writing = false;
+            m_cv.notify_all();
+        }
+        return durable() >= ticket;
+    }
+
+    wal_stats stats() {
+        std::lock_guard lk(m_mutex_);
+        return m_stats;
+    }
+
+    // Reads the log at `path` and calls apply(partition, record) for every
+    // record of every intact frame. Frames are checked and decoded on up to
+    // `threads` threads, records are then split by key hash into as many
+    // partitions, which are applied concurrently. Within a partition, so
+    // for every key, records come in log order.
+    template <typename F>
+    static replay_result replay(const std::string &path, unsigned threads,
+                                F apply) {
+        replay_result res;
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            // only a missing log is an empty one
+            std::error_code ec;
+            res.readable = !std::filesystem::exists(path, ec) && !ec;
+            return res;
+        }
+        const std::string data(std::istreambuf_iterator<char>(in), {});
+        if (in.bad()) {
+            res.readable = false;
+            return res;
+        }
+
+        // frame boundaries, checksums are checked below
+        std::vector<std::pair<uint64_t, uint32_t>> frames;
+        uint64_t pos = 0;
+        while (data.size() - pos >= 8) {
+            uint32_t len;
+            std::memcpy(&len, data.data() + pos, 4);
+            if (data.size() - pos - 8 < len) {
+                break;
+            }
+            frames.emplace_back(pos + 8, len);
+            pos += 8 + uint64_t(len);
+        }
+        if (frames.empty()) {
+            return res;
+        }
+
+        threads = std::clamp<unsigned>(threads, 1, frames.size());
+        // records[t][p]: partition p's records from thread t's frames
+        std::vector<std::vector<std::vector<wal_record>>> records(
+            threads, std::vector<std::vector<wal_record>>(threads));
+        std::atomic<size_t> first_bad = frames.size();
+        auto decode = [&](unsigned t) {
+            const size_t from = frames.size() * t / threads;
+            const size_t to = frames.size() * (t + 1) / threads;
+            for (size_t f = from; f < to && f < first_bad; ++f) {
+                if (!decode_frame(data, frames[f], records[t])) {
+                    size_t cur = first_bad;
+                    while (f < cur &&
+                           !first_bad.compare_exchange_weak(cur, f)) {
+                    }
+                    return;
+                }
+            }
+        };
+        run_on(threads, decode);
+
+        // The thread owning the first bad frame stopped right before it,
+        // drop what threads behind it decoded.
+        const size_t good = first_bad;
+        for (unsigned t = 0; t < threads; ++t) {
+            if (frames.size() * t / threads > good) {
+                for (auto &part : records[t]) {
+                    part.clear();
+                }
+            }
+        }
+
+        auto apply_part = [&](unsigned p) {
+            for (unsigned t = 0; t < threads; ++t) {
+                for (const wal_record &r : records[t][p]) {
+                    apply(p, r);
+                }
+            }
+        };
+        run_on(threads, apply_part);
+
+        res.frames = good;
+        for (unsigned t = 0; t < threads; ++t) {
+            for (const auto &part : records[t]) {
+                res.records += part.size();
+            }
+        }
+        res.valid_size = good == frames.size() ? pos : frames[good].first - 8;
+        return res;
+    }
+
+  private:
+    // appends the records of one frame to their partitions,
+    // false if the frame is corrupt
+    static bool decode_frame(const std::string &data,
+                             std::pair<uint64_t, uint32_t> frame,
+                             std::vector<std::vector<wal_record>> &parts) {
+        const std::string_view payload(data.data() + frame.first,
+                                       frame.second);
+        uint32_t crc;
+        std::memcpy(&crc, data.data() + frame.first - 4, 4);
+        if (crc32c(payload) != crc) {
+            return false;
+        }
+        // a frame is applied whole or not at all
+        std::vector<wal_record> decoded;
+        const char *p = payload.data();
+        const char *end = p + payload.size();
+        while (p != end) {
+            uint32_t key_len, val_len;
+            if (end - p < 9) {
+                return false;
+            }
+            const wal_op op = wal_op(uint8_t(*p));
+            std::memcpy(&key_len, p + 1, 4);
+            std::memcpy(&val_len, p + 5, 4);
+            p += 9;
+            if (size_t(end - p) < size_t(key_len) + val_len ||
+                (op != wal_op::set && op != wal_op::remove)) {
+                return false;
+            }
+            const std::string_view key(p, key_len);
+            decoded.push_back({op, key, std::string_view(p + key_len, val_len),
+                               std::hash<std::string_view>{}(key)});
+            p += key_len + val_len;
+        }
+        for (const wal_record &r : decoded) {
+            parts[r.hash % parts.size()].push_back(r);
+        }
+        return true;
+    }
+
+    template <typename F> static void run_on(unsigned threads, F &f) {
+        std::vector<std::thread> pool;
+        for (unsigned t = 1; t < threads; ++t) {
+            pool.emplace_back([&f, t] { f(t); });
+        }
+        f(0);
+        for (auto &th : pool) {
+            th.join();
+        }
+    }
+
+    bool write_out(const std::string &buf) {
+        const char *p = buf.data();
+        size_t left = buf.size();
+        while (left > 0) {
+#if defined(_WIN32)
+            const int n = ::_write(m_fd, p, unsigned(left));
+#else
+            const ssize_t n = ::write(m_fd, p, left);
+#endif
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+        if (!m_cfg.sync) {
+            return true;
+        }
+#if defined(_WIN32)
+        return ::_commit(m_fd) == 0;
+#elif defined(__APPLE__)
+        return ::fsync(m_fd) == 0;
+#else
+        return ::fdatasync(m_fd) == 0;
+#endif
+    }
+
+    void close_fd() {
+        if (m_fd >= 0) {
+#if defined(_WIN32)
+            ::_close(m_fd);
+#else
+            ::close(m_fd);
+#endif
+            m_fd = -1;
+        }
+    }
+
+    wal_config m_cfg;
+    int m_fd = -1;
+    std::mutex m_mutex_;
+    std::condition_variable m_cv;
+    // frames queued for the next group and the group being written
+    std::string m_pending;
+    std::string m_writing_buf;
+    uint64_t m_appended = 0;
+    // handed out to waiters, whether the write worked or not
+    uint64_t m_durable = 0;
+    // written out successfully
+    std::atomic<uint64_t> m_synced = 0;
+    bool _writing = false;
+    // written under m_mutex_, ok() reads it without
+    std::atomic<bool> _failed = false;
+    wal_stats m_stats;
+};
@@ -1,6 +1,9 @@
 #include "cache.h"
 #include "mock_db.h"
 #include "pipeline.h"
+#ifdef CACHE_WITH_ASIO
+#include "server.h"
+#endif
 
 void task1() {
     std::cout << "task1\n";
@@ -30,14 +33,108 @@ const char *help =
     5 - commit transaction
     6 - abort transaction
     7 - print help
+    8 - flush pending writes (write-back mode)
+    9 - print stats
     0 - exit
     )";
 
-int main() {
+const char *usage =
+    R"(usage: cache_files [options]
+    --write-back       acknowledge writes before they reach the upstream
+    --serve <port>     serve the cache over TCP instead of the menu
+    --unix <path>      serve the cache over a unix socket
+    --bind <address>   TCP address to listen on (default 127.0.0.1)
+    --threads <n>      server threads (default: hardware concurrency)
+    --stats-file <path>     periodically write stats as JSON to <path>
+    --stats-interval <ms>   stats file period (default 1000)
+    --snapshot <path>       warm start from <path> and keep it up to date
+    --snapshot-interval <s> snapshot period (default 60)
+    --near-cache <slots>    per thread near cache for hot keys (default off)
+    --wal <path>            make mock_db durable with a write-ahead log
+    --wal-interval <us>     group commit wait before each log write (default 0)
+    )";
+
+std::string stats_snapshot(cache &ch, mock_db &db) {
+    return "{\"cache\": " + ch.stats_json() +
+           ", \"mock_db\": " + db.stats_json() + "}\n";
+}
+
+int main(int argc, char *argv[]) {
     bool run = true;
     int action = 0;
-    mock_db db;
-    cache ch(&db);
+    cache_config cfg;
+    int port = -1;
+    int threads = 0;
+    std::string bind_addr = "127.0.0.1";
+    std::string unix_path;
+    std::string stats_path;
+    int stats_interval = 1000;
+    wal_config wal;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--write-back") {
+            cfg.policy = write_policy::back;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--unix" && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (arg == "--bind" && i + 1 < argc) {
+            bind_addr = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (arg == "--stats-file" && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            cfg.snapshot_path = argv[++i];
+        } else if (arg == "--snapshot-interval" && i + 1 < argc) {
+            cfg.snapshot_interval =
+                std::chrono::seconds(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--near-cache" && i + 1 < argc) {
+            cfg.near_slots = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--wal" && i + 1 < argc) {
+            wal.path = argv[++i];
+        } else if (arg == "--wal-interval" && i + 1 < argc) {
+            wal.flush_interval =
+                std::chrono::microseconds(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--stats-interval" && i + 1 < argc) {
+            stats_interval = std::max(1, std::atoi(argv[++i]));
+        } else {
+            std::cerr << usage;
+            return -1;
+        }
+    }
+    auto db_ptr = wal.path.empty() ? std::make_unique<mock_db>()
+                                   : std::make_unique<mock_db>(wal);
+    mock_db &db = *db_ptr;
+    if (!db.ok()) {
+        std::cerr << "can't open write-ahead log " << wal.path << "\n";
+        return -1;
+    }
+    cache ch(&db, 12, cfg);
+    std::unique_ptr<stats_reporter> reporter;
+    if (!stats_path.empty()) {
+        reporter = std::make_unique<stats_reporter>(
+            stats_path, std::chrono::milliseconds(stats_interval),
+            [&] { return stats_snapshot(ch, db); });
+    }
+
+    if (port >= 0 || !unix_path.empty()) {
+#ifdef CACHE_WITH_ASIO
+        cache_server srv(ch, threads);
+        if (port >= 0) {
+            srv.listen_tcp(bind_addr, port);
+        }
+        if (!unix_path.empty()) {
+            srv.listen_unix(unix_path);
+        }
+        srv.run();
+        return 0;
+#else
+        std::cerr << "built without asio, server mode is unavailable\n";
+        return -1;
+#endif
+    }
+
     std::cout << help;
 
     std::string key;
@@ -52,7 +149,7 @@ int main() {
         case 1:
             std::cout << "provide key:";
             std::cin >> key;
-            std::cout << ch.get(key) << "\n";
+            std::cout << ch.get_ref(key).value() << "\n";
             break;
         case 2:
             std::cout << "provide key:";
@@ -79,6 +176,12 @@ int main() {
         case 7:
             std::cout << help;
             break;
+        case 8:
+            ch.flush();
+            break;
+        case 9:
+            std::cout << stats_snapshot(ch, db);
+            break;
         default:
             break;
         }
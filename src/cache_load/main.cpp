@@ -0,0 +1,221 @@
+// Load client for `cache_files --serve`: every connection runs on its own
+// thread and sends pipelined batches of GET/SET requests.
+#if __has_include(<asio.hpp>)
+#include <asio.hpp>
+#else
+// boost 1.74 asio uses std::exchange without including it
+#include <utility>
+
+#include <boost/asio.hpp>
+namespace asio = boost::asio;
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct load_opts {
+    std::string host = "127.0.0.1";
+    std::string port = "6380";
+    std::string unix_path;
+    int conns = 4;
+    int requests = 100000; // per connection
+    int pipeline = 32;
+    int keys = 10000;
+    double set_ratio = 0.1;
+    int value_size = 32;
+};
+
+const char *usage =
+    R"(usage: cache_load [options]
+    --host <address>    (default 127.0.0.1)
+    --port <port>       (default 6380)
+    --unix <path>       connect to a unix socket instead
+    --conns <n>         parallel connections (default 4)
+    --requests <n>      requests per connection (default 100000)
+    --pipeline <n>      requests in flight per connection (default 32)
+    --keys <n>          key space size (default 10000)
+    --set-ratio <f>     share of SET requests (default 0.1)
+    --value-size <n>    SET payload bytes (default 32)
+    )";
+
+static void append_command(std::string &out,
+                           std::initializer_list<std::string_view> args) {
+    out += '*';
+    out += std::to_string(args.size());
+    out += "\r\n";
+    for (std::string_view a : args) {
+        out += '$';
+        out += std::to_string(a.size());
+        out += "\r\n";
+        out += a;
+        out += "\r\n";
+    }
+}
+
+// number of complete replies at the front of `in`, `used` gets their size
+static int count_replies(std::string_view in, size_t &used, long &errors) {
+    int replies = 0;
+    used = 0;
+    while (used < in.size()) {
+        size_t eol = in.find("\r\n", used);
+        if (eol == std::string_view::npos) {
+            break;
+        }
+        size_t next = eol + 2;
+        if (in[used] == '-') {
+            ++errors;
+        } else if (in[used] == '$') {
+            std::string len_str(in.substr(used + 1, eol - used - 1));
+            long len = std::stol(len_str);
+            if (len >= 0) {
+                if (in.size() < next + len + 2) {
+                    break;
+                }
+                next += len + 2;
+            }
+        }
+        used = next;
+        ++replies;
+    }
+    return replies;
+}
+
+template <typename Socket>
+static void run_conn(Socket &sock, const load_opts &opts, unsigned seed,
+                     std::vector<double> &batch_us, std::atomic<long> &errors) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> key_dist(0, opts.keys - 1);
+    std::bernoulli_distribution is_set(opts.set_ratio);
+    const std::string value(opts.value_size, 'v');
+
+    std::string out;
+    std::string in;
+    std::vector<char> buf(64 * 1024);
+    for (int sent = 0; sent < opts.requests;) {
+        const int batch = std::min(opts.pipeline, opts.requests - sent);
+        out.clear();
+        for (int i = 0; i < batch; ++i) {
+            std::string key = "key:" + std::to_string(key_dist(gen));
+            if (is_set(gen)) {
+                append_command(out, {"SET", key, value});
+            } else {
+                append_command(out, {"GET", key});
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        asio::write(sock, asio::buffer(out));
+        int replies = 0;
+        while (replies < batch) {
+            size_t n = sock.read_some(asio::buffer(buf));
+            in.append(buf.data(), n);
+            size_t used = 0;
+            long errs = 0;
+            replies += count_replies(in, used, errs);
+            errors += errs;
+            in.erase(0, used);
+        }
+        auto end = std::chrono::steady_clock::now();
+        batch_us.push_back(
+            std::chrono::duration<double, std::micro>(end - start).count());
+        sent += batch;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    load_opts opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        const char *val = argv[i + 1];
+        if (arg == "--host") {
+            opts.host = val;
+        } else if (arg == "--port") {
+            opts.port = val;
+        } else if (arg == "--unix") {
+            opts.unix_path = val;
+        } else if (arg == "--conns") {
+            opts.conns = std::atoi(val);
+        } else if (arg == "--requests") {
+            opts.requests = std::atoi(val);
+        } else if (arg == "--pipeline") {
+            opts.pipeline = std::max(1, std::atoi(val));
+        } else if (arg == "--keys") {
+            opts.keys = std::max(1, std::atoi(val));
+        } else if (arg == "--set-ratio") {
+            opts.set_ratio = std::atof(val);
+        } else if (arg == "--value-size") {
+            opts.value_size = std::atoi(val);
+        } else {
+            std::cerr << usage;
+            return -1;
+        }
+    }
+    if (argc % 2 == 0) {
+        std::cerr << usage;
+        return -1;
+    }
+
+    std::vector<std::vector<double>> batch_us(opts.conns);
+    std::atomic<long> errors = 0;
+    std::atomic<int> failed = 0;
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < opts.conns; ++c) {
+        workers.emplace_back([&, c] {
+            try {
+                asio::io_context io;
+#if defined(ASIO_HAS_LOCAL_SOCKETS) || defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+                if (!opts.unix_path.empty()) {
+                    asio::local::stream_protocol::socket sock(io);
+                    sock.connect(asio::local::stream_protocol::endpoint(
+                        opts.unix_path));
+                    run_conn(sock, opts, c, batch_us[c], errors);
+                    return;
+                }
+#endif
+                asio::ip::tcp::socket sock(io);
+                asio::ip::tcp::resolver resolver(io);
+                asio::connect(sock, resolver.resolve(opts.host, opts.port));
+                sock.set_option(asio::ip::tcp::no_delay(true));
+                run_conn(sock, opts, c, batch_us[c], errors);
+            } catch (const std::exception &e) {
+                std::cerr << "connection " << c << ": " << e.what() << "\n";
+                ++failed;
+            }
+        });
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (failed > 0) {
+        return -1;
+    }
+
+    std::vector<double> all;
+    for (auto &v : batch_us) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto pct = [&](double p) {
+        return all.empty() ? 0.0 : all[size_t(p * (all.size() - 1))];
+    };
+    const double secs = std::chrono::duration<double>(end - start).count();
+    const long total = long(opts.requests) * opts.conns;
+
+    std::cout << "requests:     " << total << "\n"
+              << "errors:       " << errors << "\n"
+              << "seconds:      " << secs << "\n"
+              << "ops/sec:      " << long(total / secs) << "\n"
+              << "batch p50 us: " << pct(0.50) << "\n"
+              << "batch p99 us: " << pct(0.99) << "\n";
+    return 0;
+}
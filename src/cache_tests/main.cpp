@@ -0,0 +1,427 @@
+// Regression tests for the cache headers, run by ctest. Every test returns
+// false on failure after printing what went wrong.
+#include "cache.h"
+#include "flat_map.h"
+#include "mock_db.h"
+#include "pipeline.h"
+#include "snapshot.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <sys/resource.h>
+#endif
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n";       \
+            return false;                                                      \
+        }                                                                      \
+    } while (0)
+
+// fail_policy::abort stops at the first failing op even when the batch is
+// big enough to be split by key across the worker pool
+bool pipeline_abort_stops_later_ops() {
+    using fp = Pipeline::fail_policy;
+    for (int round = 0; round < 50; ++round) {
+        mock_db db;
+        db.set_policy(fp::abort);
+        CHECK(db.begin_transaction());
+        db.set("a", "early");
+        db.remove("missing");
+        for (int i = 0; i < 100; ++i) {
+            db.set("k" + std::to_string(i), "v");
+        }
+        db.set("a", "after_abort");
+        CHECK(!db.commit_transaction());
+        CHECK(db.get("a") == "early");
+        CHECK(db.get("k0") == "");
+    }
+    return true;
+}
+
+// a transaction only buffers its own thread's calls, writes of other
+// threads go through right away and make it fail if it read their keys
+bool transaction_conflicts_with_other_threads() {
+    mock_db db;
+    cache ch(&db);
+    ch.set("y", "before");
+
+    CHECK(ch.begin_transaction());
+    CHECK(ch.get("y") == "before");
+    ch.set("x", "tx");
+    std::string other;
+    std::thread([&] { other = ch.set("y", "other"); }).join();
+    CHECK(other == "other");
+    CHECK(db.get("y") == "other");
+    CHECK(!ch.commit_transaction());
+    CHECK(ch.stats().read(cache_stats::tx_conflicts) == 1);
+    CHECK(ch.get("x") == "");
+
+    // aborting doesn't take other threads' writes with it
+    CHECK(ch.begin_transaction());
+    ch.set("x", "tx");
+    std::thread([&] { ch.set("z", "other"); }).join();
+    CHECK(ch.abort_transaction());
+    CHECK(ch.get("z") == "other");
+    CHECK(ch.get("x") == "");
+    return true;
+}
+
+// a log that can't be opened makes the db refuse writes instead of
+// applying them in memory only
+bool unopenable_wal_refuses_writes() {
+    wal_config cfg;
+    cfg.path = "/nonexistent/dir/cache_tests.wal";
+    mock_db db(cfg);
+    CHECK(!db.ok());
+    CHECK(db.set("k", "v") == "");
+    CHECK(db.get("k") == "");
+    CHECK(db.begin_transaction());
+    db.set("k", "v");
+    CHECK(!db.commit_transaction());
+    CHECK(db.get("k") == "");
+    return true;
+}
+
+// write-back answers DEL like write-through: "ok" only for keys that exist
+bool write_back_remove_results() {
+    mock_db db;
+    db.set("up", "v");
+    cache_config cfg;
+    cfg.policy = write_policy::back;
+    cache ch(&db, 12, cfg);
+    ch.set("k", "v");
+    CHECK(ch.remove("k") == "ok");
+    CHECK(ch.remove("k") == "");
+    CHECK(ch.remove("never") == "");
+    CHECK(ch.remove("up") == "ok");
+    CHECK(ch.remove("up") == "");
+    ch.flush();
+    CHECK(db.get("k") == "");
+    CHECK(db.get("up") == "");
+    return true;
+}
+
+// random inserts, overwrites and erases agree with std::unordered_map,
+// through growth, erase_if and clear
+bool flat_map_matches_unordered_map() {
+    flat_map fm;
+    std::unordered_map<std::string, std::string> ref;
+    std::mt19937_64 rng(42);
+    auto check_all = [&] {
+        CHECK(fm.size() == ref.size());
+        for (const auto &[k, v] : ref) {
+            const flat_entry *e = fm.find(k);
+            CHECK(e != nullptr && e->value() == v);
+        }
+        size_t seen = 0;
+        fm.for_each([&](const flat_entry &e) {
+            auto it = ref.find(std::string(e.key()));
+            seen += it != ref.end() && it->second == e.value();
+        });
+        CHECK(seen == ref.size());
+        return true;
+    };
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 20000; ++i) {
+            const std::string key = "k" + std::to_string(rng() % 3000);
+            if (rng() % 3 == 0) {
+                CHECK(fm.erase(key) == (ref.erase(key) == 1));
+                CHECK(fm.find(key) == nullptr);
+            } else {
+                // values of every size class, some past the largest
+                const size_t len = i % 500 == 0 ? 70000 : rng() % 300;
+                const std::string val(len, char('a' + rng() % 26));
+                fm.assign(key, val, 1);
+                ref[key] = val;
+            }
+        }
+        if (!check_all()) {
+            return false;
+        }
+        const size_t erased = fm.erase_if(
+            [](const flat_entry &e) { return e.value().size() % 2 == 0; });
+        CHECK(erased == std::erase_if(ref, [](const auto &kv) {
+                  return kv.second.size() % 2 == 0;
+              }));
+        if (!check_all()) {
+            return false;
+        }
+    }
+    fm.clear();
+    ref.clear();
+    return check_all();
+}
+
+// plain calls made while another thread's upstream transaction is open
+// must not end up inside it
+bool plain_ops_during_commit() {
+    // slow sets keep the upstream transaction open for a while
+    struct slow_db : mock_db {
+        std::string set(const std::string &key,
+                        const std::string &data) override {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            return mock_db::set(key, data);
+        }
+    };
+    slow_db db;
+    cache ch(&db);
+    std::thread committer([&] {
+        for (int i = 0; i < 200; ++i) {
+            ch.begin_transaction();
+            ch.set("t" + std::to_string(i), "tx");
+            ch.set("u" + std::to_string(i), "tx");
+            ch.commit_transaction();
+        }
+    });
+    bool ok = true;
+    for (int i = 0; i < 200 && ok; ++i) {
+        const std::string key = "w" + std::to_string(i);
+        ok = ch.set(key, "val") == "val" && ch.get(key) == "val" &&
+             ch.get("missing" + std::to_string(i)) == "";
+    }
+    committer.join();
+    CHECK(ok);
+    for (int i = 0; i < 200; ++i) {
+        CHECK(db.get("w" + std::to_string(i)) == "val");
+        CHECK(db.get("t" + std::to_string(i)) == "tx");
+    }
+    return true;
+}
+
+// a transaction fails if a key it read went away meanwhile, even one
+// that wasn't cached
+bool transaction_sees_removes_of_uncached_keys() {
+    // the next get waits in the upstream until released
+    struct gated_db : mock_db {
+        std::promise<void> entered, release;
+        bool armed = false;
+        std::string get(const std::string &key) override {
+            std::string res = mock_db::get(key);
+            if (armed) {
+                armed = false;
+                entered.set_value();
+                release.get_future().wait();
+            }
+            return res;
+        }
+    };
+    gated_db db;
+    db.set("k", "v");
+    cache ch(&db);
+
+    db.armed = true;
+    auto committed = std::async(std::launch::async, [&] {
+        ch.begin_transaction();
+        ch.get("k");
+        return ch.commit_transaction();
+    });
+    db.entered.get_future().wait();
+    CHECK(ch.remove("k") == "ok");
+    db.release.set_value();
+    CHECK(!committed.get());
+
+    // an absent key that is set and removed again
+    CHECK(ch.begin_transaction());
+    CHECK(ch.get("a") == "");
+    std::thread([&] {
+        ch.set("a", "x");
+        ch.remove("a");
+    }).join();
+    CHECK(!ch.commit_transaction());
+    CHECK(ch.stats().read(cache_stats::tx_conflicts) == 2);
+    return true;
+}
+
+// a snapshot saved by one cache loads into another, entries that expired
+// in the file are skipped
+bool snapshot_round_trip_skips_expired() {
+    const std::string path = "cache_tests.snap";
+    mock_db db;
+    {
+        cache ch(&db, 100);
+        for (int i = 0; i < 5000; ++i) {
+            ch.set("k" + std::to_string(i), std::string(1 + i % 100, 'v'));
+        }
+        CHECK(ch.save_snapshot(path));
+        CHECK(ch.stats().read(cache_stats::snapshot_saved_keys) == 5000);
+    }
+    {
+        // the upstream lost everything, values must come from the file
+        mock_db empty;
+        cache ch(&empty, 100);
+        CHECK(ch.load_snapshot(path) == 5000);
+        for (int i = 0; i < 5000; ++i) {
+            CHECK(ch.get("k" + std::to_string(i)) ==
+                  std::string(1 + i % 100, 'v'));
+        }
+    }
+
+    const uint64_t now =
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    {
+        snapshot_writer out(path);
+        CHECK(out.ok());
+        out.add("live", "1", now + 100);
+        out.add("dead", "2", now - 1);
+        out.drain();
+        CHECK(out.commit());
+    }
+    mock_db empty;
+    cache ch(&empty, 100);
+    CHECK(ch.load_snapshot(path) == 1);
+    CHECK(ch.get("live") == "1");
+    CHECK(ch.get("dead") == "");
+    std::remove(path.c_str());
+    return true;
+}
+
+// get_ref, which the menu and the server read through, is served from
+// the near cache once a key is hot
+bool get_ref_uses_near_cache() {
+    mock_db db;
+    cache_config cfg;
+    cfg.near_slots = 64;
+    cache ch(&db, 100, cfg);
+    ch.set("hot", "v");
+    for (int i = 0; i < 100; ++i) {
+        CHECK(ch.get_ref("hot").value() == "v");
+    }
+    CHECK(ch.stats().read(cache_stats::near_hits) > 90);
+    ch.set("hot", "w");
+    CHECK(ch.get_ref("hot").value() == "w");
+    return true;
+}
+
+// replay applies every intact frame, stops at a corrupt trailing one and
+// the log is cut back to the intact prefix before new frames go in
+bool wal_replay_cuts_corrupt_tail() {
+    wal_config cfg;
+    cfg.path = "cache_tests.wal";
+    cfg.sync = false;
+    std::remove(cfg.path.c_str());
+    {
+        mock_db db(cfg);
+        CHECK(db.ok());
+        db.set("a", "1");
+        db.set("b", "2");
+        db.begin_transaction();
+        db.set("c", "3");
+        db.remove("a");
+        CHECK(db.commit_transaction());
+    }
+    uint64_t intact;
+    {
+        std::ifstream in(cfg.path, std::ios::binary | std::ios::ate);
+        intact = in.tellg();
+    }
+    {
+        // a whole frame whose payload doesn't match its checksum
+        wal_batch b;
+        b.add(wal_op::set, "d", "4");
+        const uint32_t len = b.payload().size();
+        const uint32_t crc = crc32c(b.payload()) ^ 1;
+        std::ofstream out(cfg.path, std::ios::binary | std::ios::app);
+        out.write(reinterpret_cast<const char *>(&len), 4);
+        out.write(reinterpret_cast<const char *>(&crc), 4);
+        out.write(b.payload().data(), len);
+    }
+
+    auto res = write_ahead_log::replay(
+        cfg.path, 4, [](unsigned, const wal_record &) {});
+    CHECK(res.readable);
+    CHECK(res.frames == 3);
+    CHECK(res.records == 4);
+    CHECK(res.valid_size == intact);
+    {
+        mock_db db(cfg);
+        CHECK(db.ok());
+        CHECK(db.get("a") == "");
+        CHECK(db.get("b") == "2");
+        CHECK(db.get("c") == "3");
+        CHECK(db.get("d") == "");
+        db.set("e", "5");
+    }
+    mock_db db(cfg);
+    CHECK(db.get("e") == "5");
+    CHECK(db.get("b") == "2");
+    std::remove(cfg.path.c_str());
+    return true;
+}
+
+// a write whose log write fails is rolled back and reported as failed
+bool wal_failure_rolls_back() {
+#if !defined(_WIN32)
+    wal_config cfg;
+    cfg.path = "cache_tests.wal";
+    cfg.sync = false;
+    std::remove(cfg.path.c_str());
+    mock_db db(cfg);
+    CHECK(db.set("k", "old") == "old");
+
+    // writes past the file size limit fail with EFBIG
+    rlimit saved;
+    getrlimit(RLIMIT_FSIZE, &saved);
+    auto old_handler = std::signal(SIGXFSZ, SIG_IGN);
+    rlimit small = saved;
+    small.rlim_cur = 4096;
+    setrlimit(RLIMIT_FSIZE, &small);
+    const std::string set_res = db.set("k", std::string(8192, 'n'));
+    db.begin_transaction();
+    db.set("t", "tx");
+    const bool committed = db.commit_transaction();
+    setrlimit(RLIMIT_FSIZE, &saved);
+    std::signal(SIGXFSZ, old_handler);
+
+    CHECK(set_res == "");
+    CHECK(db.get("k") == "old");
+    CHECK(!committed);
+    CHECK(db.get("t") == "");
+    CHECK(!db.ok());
+    std::remove(cfg.path.c_str());
+#endif
+    return true;
+}
+
+int main() {
+    // more threads than this machine may have, so the parallel commit path
+    // runs everywhere
+    worker_pool::set_shared_threads(4);
+
+    const std::vector<std::pair<const char *, std::function<bool()>>> tests = {
+        {"pipeline_abort_stops_later_ops", pipeline_abort_stops_later_ops},
+        {"transaction_conflicts_with_other_threads",
+         transaction_conflicts_with_other_threads},
+        {"unopenable_wal_refuses_writes", unopenable_wal_refuses_writes},
+        {"write_back_remove_results", write_back_remove_results},
+        {"flat_map_matches_unordered_map", flat_map_matches_unordered_map},
+        {"plain_ops_during_commit", plain_ops_during_commit},
+        {"transaction_sees_removes_of_uncached_keys",
+         transaction_sees_removes_of_uncached_keys},
+        {"snapshot_round_trip_skips_expired",
+         snapshot_round_trip_skips_expired},
+        {"get_ref_uses_near_cache", get_ref_uses_near_cache},
+        {"wal_replay_cuts_corrupt_tail", wal_replay_cuts_corrupt_tail},
+        {"wal_failure_rolls_back", wal_failure_rolls_back},
+    };
+    int failed = 0;
+    for (const auto &[name, test] : tests) {
+        const bool ok = test();
+        std::cout << (ok ? "pass " : "FAIL ") << name << "\n";
+        failed += !ok;
+    }
+    return failed == 0 ? 0 : 1;
+}